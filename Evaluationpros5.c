@@ -1,204 +1,7009 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
 
 #define MAX_FILENAME_LENGTH 100
-#define MAX_FILES 100
-#define MAX_DATA_BLOCKS 1000
+#define MAX_PATH_LENGTH 4096
+#define MAX_PATH_DEPTH 256
+#define INITIAL_DENTRY_CACHE_CAPACITY 128
+#define MAX_DENTRY_CACHE_CAPACITY 65536
+#define BTREE_MIN_DEGREE 16
+#define BTREE_MAX_KEYS (2 * BTREE_MIN_DEGREE - 1)
 #define DATA_BLOCK_SIZE 1024
+#define MAX_EXTENTS 8
+#define CACHE_FRAMES 256
+#define CACHE_BUCKETS 512
+#define FLUSH_INTERVAL_MS 100
+#define DIRTY_HIGH_WATERMARK (CACHE_FRAMES / 2)
+#define DELAYED_FLUSH_INTERVAL_MS 1000
+#define DELAYED_HIGH_WATERMARK 256
+#define MAX_IO_RUN 32
+#define MAX_VIEW_SPANS 64
+#define IO_RING_ENTRIES 128
+#define IO_WORKERS 4
+#define IO_RETRY_DELAY_NS 1000000
+#define IO_OP_READ 0
+#define IO_OP_WRITE 1
+#define MAX_OPEN_FILES 1024
+#define OPEN_READ 0x1
+#define OPEN_WRITE 0x2
+#define READAHEAD_INITIAL_WINDOW 4
+#define READAHEAD_MAX_WINDOW 64
+#define READAHEAD_QUEUE_SIZE 64
+#define RECLAIM_EPOCHS 3
+#define LOCKLESS_RETRIES 16
+#define BLOCKS_PER_GROUP 256
+#define GROUP_WORDS (BLOCKS_PER_GROUP / 64)
+#define MAGAZINE_BLOCKS 8
+#define MAX_MAGAZINES 16
 
+#define ALLOCATION_BEST_FIT 0
+#define ALLOCATION_NEXT_FIT 1
+
+#define FILE_TYPE_REGULAR 0
+#define FILE_TYPE_DIRECTORY 1
+
+// Where a small file keeps its last bytes instead of a block of its own.
+// Inline data sits in the inode in place of the extents; a packed tail sits
+// in TAIL_SLOT_SIZE slots of a block shared with other files' tails.
+#define FILE_INLINE 0x1
+#define FILE_TAIL 0x2
+#define TAIL_SLOT_SIZE 64
+#define TAIL_SLOTS (DATA_BLOCK_SIZE / TAIL_SLOT_SIZE)
+#define MAX_TAIL_LENGTH (DATA_BLOCK_SIZE / 2)
+
+// A FILE_COMPRESSED file stores its data in units of COMPRESSION_UNIT_BLOCKS
+// logical blocks, each squeezed into as few blocks as it fits. Their
+// expanded blocks are cached under keys past any block number.
+#define FILE_COMPRESSED 0x4
+#define EXTENT_COMPRESSED 0x1
+
+// Snapshots live in SNAPSHOT_DIRECTORY under the root. Their files and
+// directories are FILE_SNAPSHOT and read-only.
+#define FILE_SNAPSHOT 0x8
+#define SNAPSHOT_DIRECTORY ".snapshots"
+#define COMPRESSION_UNIT_BLOCKS 16
+#define COMPRESSION_UNIT_SIZE (COMPRESSION_UNIT_BLOCKS * DATA_BLOCK_SIZE)
+#define COMPRESSION_HASH_BITS 12
+#define COMPRESSION_MIN_MATCH 4
+#define COMPRESSION_MAX_OFFSET 65535
+#define COMPRESSED_KEY_BASE ((int64_t) 1 << 40)
+#define COMPRESSED_KEY(start, index) (COMPRESSED_KEY_BASE + (int64_t) (start) * COMPRESSION_UNIT_BLOCKS + (index))
+
+// CRC32C (Castagnoli), reflected. The scrubber checks SCRUB_BATCH_BLOCKS at a
+// time, pausing SCRUB_INTERVAL_MS between batches and SCRUB_PASS_INTERVAL_MS
+// between passes over the volume.
+#define CRC32C_POLYNOMIAL 0x82f63b78
+#define SCRUB_BATCH_BLOCKS 64
+#define SCRUB_INTERVAL_MS 10
+#define SCRUB_PASS_INTERVAL_MS 10000
+
+// The dedup index has DEDUP_INDEX_SLOTS entries; a fingerprint is looked for
+// in the DEDUP_PROBE_SLOTS slots from its home slot on.
+#define DEDUP_INDEX_SLOTS 4096
+#define DEDUP_PROBE_SLOTS 8
+
+#define ROOT_INODE 0
+
+#define VOLUME_IMAGE_PATH "volume.img"
+#define VOLUME_MAGIC 0x4f534653
+#define VOLUME_VERSION 7
+#define SUPERBLOCK_SIZE 4096
+
+// Geometry of volumes created by initializeFileSystem. The counts can grow
+// while mounted, up to the limits chosen at format time.
+#define DEFAULT_BLOCK_COUNT 1000
+#define DEFAULT_BLOCK_LIMIT (1 << 20)
+#define DEFAULT_INODE_CAPACITY 1024
+#define DEFAULT_INODE_LIMIT 262144
+#define BITMAP_WORDS(blocks) (((size_t) (blocks) + 63) / 64)
+#define GROUPS_FOR(blocks) (((blocks) + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP)
+
+// Feature flags recorded in the superblock. A volume using a feature this
+// build does not know about is refused at mount time.
+#define FEATURE_EXTENTS 0x1
+#define FEATURE_JOURNAL 0x2
+#define FEATURE_INLINE_DATA 0x4
+#define FEATURE_COMPRESSION 0x8
+#define FEATURE_CHECKSUMS 0x10
+#define FEATURE_SHARED_BLOCKS 0x20
+#define SUPPORTED_FEATURES                                                                           \
+    (FEATURE_EXTENTS | FEATURE_JOURNAL | FEATURE_INLINE_DATA | FEATURE_COMPRESSION | FEATURE_CHECKSUMS | \
+     FEATURE_SHARED_BLOCKS)
+
+#define JOURNAL_MAGIC 0x4a4e524c
+#define JOURNAL_VERSION 1
+#define JOURNAL_RECORD_MAGIC 0x4a524543
+#define JOURNAL_HEADER_SIZE 512
+#define JOURNAL_CHECKPOINT_SIZE (4 * 1024 * 1024)
+
+// A run of length contiguous data blocks starting at block start, holding
+// the file's blocks from logical block logical on. An EXTENT_COMPRESSED run
+// holds one compression unit instead, so it spans COMPRESSION_UNIT_BLOCKS
+// logical blocks whatever its length.
+typedef struct {
+    int start;
+    int length;
+    int logical;
+    int flags;
+} Extent;
+
+// Extents past the MAX_EXTENTS kept in the inode go to one extent block.
+#define EXTENTS_PER_BLOCK ((int) (DATA_BLOCK_SIZE / sizeof(Extent)))
+#define MAX_FILE_EXTENTS (MAX_EXTENTS + EXTENTS_PER_BLOCK)
+#define MAX_FILE_BLOCKS (1 << 30)
+#define MAX_FILE_SIZE ((int64_t) MAX_FILE_BLOCKS * DATA_BLOCK_SIZE)
+#define INLINE_DATA_SIZE (MAX_EXTENTS * (int) sizeof(Extent))
+
+// B-tree node of a directory. Keys are inode numbers ordered by the name
+// stored in the inode, so entries never duplicate the name.
+typedef struct BTreeNode {
+    int keyCount;
+    int leaf;
+    int keys[BTREE_MAX_KEYS];
+    struct BTreeNode *children[BTREE_MAX_KEYS + 1];
+} BTreeNode;
+
+// extents are sorted by logical block. extentBlock is only in use while
+// extentCount is above MAX_EXTENTS. A FILE_INLINE file has no extents and
+// keeps its contents in inlineData instead. A FILE_TAIL file keeps its last,
+// partial block at tailOffset in the shared block tailBlock. Data placed in a
+// FILE_COMPRESSED file is compressed where that saves space. A clone or
+// snapshot copy of a file starts out sharing all of its blocks.
 typedef struct {
     char name[MAX_FILENAME_LENGTH];
-    int size;
+    int64_t size;
     int permissions;
-    int firstDataBlock;
+    int type;
+    int inUse;
+    int flags;
+    uint32_t generation;
+    int parent;
+    union {
+        Extent extents[MAX_EXTENTS];
+        char inlineData[INLINE_DATA_SIZE];
+    };
+    int extentCount;
+    int extentBlock;
+    int tailBlock;
+    int tailOffset;
+    int entryCount;
 } FileMetadata;
 
+// Per-file sequential read detection. window is 0 while access looks random;
+// logical blocks below prefetchedUntil have already been queued.
+typedef struct {
+    int nextBlock;
+    int window;
+    int prefetchedUntil;
+} ReadaheadState;
+
+// A block written into a hole whose place on the volume is not chosen yet.
+typedef struct {
+    int logical;
+    char *data;
+} DelayedBlock;
+
+// In-memory state of an inode slot while mounted. lock orders access to the
+// file's data: shared for readers, exclusive for writers and deletion. It is
+// initialized once per slot and never torn down while mounted, so a thread
+// that resolved a file can still take it after the file was deleted and then
+// notice the generation changed. delayed holds the file's buffered blocks
+// sorted by logical block and is guarded by lock. compressNs and expandNs
+// are the CPU time the codec spent on the file since it was mounted.
+typedef struct {
+    pthread_rwlock_t lock;
+    pthread_mutex_t readaheadLock;
+    ReadaheadState readahead;
+    DelayedBlock *delayed;
+    int delayedCount;
+    int delayedCapacity;
+    long compressNs;
+    long expandNs;
+} InodeState;
+
+// inodes lives in the volume image; the directory B-trees, per-inode state
+// and the free list are in-memory indexes over it. The indexes are arenas
+// with room for inodeLimit slots, so they grow in place with the table.
+typedef struct {
+    FileMetadata *inodes;
+    BTreeNode **entries;
+    InodeState *states;
+    int inodeLimit;
+    int inodeCount;
+    int *freeInodes;
+    int freeInodeCount;
+} InodeTable;
+
+// Open-addressing cache from a normalized path prefix to its inode. An entry
+// is only trusted while the inode's generation still matches, so removals
+// never have to search the cache.
+typedef struct {
+    uint32_t hash;
+    int inode;
+    uint32_t generation;
+    char *path;
+} DentrySlot;
+
+typedef struct {
+    DentrySlot *slots;
+    int capacity;
+    int used;
+    long hits;
+    long misses;
+} DentryCache;
+
+// A directory entry as copied out for printing.
+typedef struct {
+    char name[MAX_FILENAME_LENGTH];
+    int type;
+    int64_t size;
+    int permissions;
+} ListingEntry;
+
+// A path split into components: text[componentStarts[i]..componentEnds[i])
+// is component i and text[0..componentEnds[i]) is the prefix through it.
 typedef struct {
-    FileMetadata files[MAX_FILES];
-    int fileCount;
-} Directory;
+    char text[MAX_PATH_LENGTH];
+    int componentStarts[MAX_PATH_DEPTH];
+    int componentEnds[MAX_PATH_DEPTH];
+    uint32_t prefixHashes[MAX_PATH_DEPTH];
+    int depth;
+} ParsedPath;
 
 typedef struct {
-    int nextDataBlock;
     char data[DATA_BLOCK_SIZE];
 } DataBlock;
 
-typedef struct {
-    int allocationTable[MAX_DATA_BLOCKS];
-} FAT;
+// A slice of the data region with its own lock, so threads allocating from
+// different groups never contend. Groups start on freeMap word boundaries and
+// never share a word. Each summary bit says whether the matching freeMap word
+// of the group still has a free block.
+typedef struct {
+    int start;
+    int end;
+    uint64_t summary;
+    int freeBlocks;
+    int nextFitCursor;
+    pthread_mutex_t lock;
+} AllocationGroup;
+
+// A run of blocks reserved from a group in one batch. Small allocations are
+// carved from the calling thread's magazine without touching a group lock.
+// Reserved blocks are marked used in freeMap, so a crash at worst leaves
+// them for rebuildFreeMap to find.
+typedef struct {
+    int start;
+    int length;
+    pthread_mutex_t lock;
+} Magazine;
+
+// One bit per data block (1 = free). freeMap lives in the volume image, the
+// group summaries and counters are rebuilt from it. groups has room for the
+// volume's block limit; groupCount of them cover the blocks it has now and
+// only ever grows. freeBlocks totals the groups' counters and parkedBlocks
+// the magazines', so a request that cannot fit is turned down without taking
+// any lock.
+typedef struct {
+    uint64_t *freeMap;
+    AllocationGroup *groups;
+    int groupCount;
+    int groupLimit;
+    Magazine magazines[MAX_MAGAZINES];
+    int magazineCount;
+    int freeBlocks;
+    int parkedBlocks;
+} FreeSpaceBitmap;
+
+// Sizes chosen when a volume is formatted. The counts can grow while it is
+// mounted; the limits are fixed.
+typedef struct {
+    uint32_t blockCount;
+    uint32_t blockLimit;
+    uint32_t inodeCapacity;
+    uint32_t inodeLimit;
+} VolumeGeometry;
+
+// First SUPERBLOCK_SIZE bytes of the image. Mounting only needs this and the
+// metadata regions it points at; data blocks are faulted in on first use.
+// The inode table and bitmap regions are sized for inodeLimit and blockLimit,
+// so blockCount and inodeCapacity can grow without moving anything.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t features;
+    uint32_t blockSize;
+    uint32_t blockCount;
+    uint32_t blockLimit;
+    uint32_t inodeCapacity;
+    uint32_t inodeLimit;
+    uint32_t inodeSize;
+    uint32_t inodeHighWater;
+    uint32_t compressNewFiles;
+    uint32_t dedupNewBlocks;
+    uint64_t inodeRegionOffset;
+    uint64_t bitmapRegionOffset;
+    uint64_t checksumRegionOffset;
+    uint64_t refcountRegionOffset;
+    uint64_t dataRegionOffset;
+    uint64_t volumeSize;
+    uint32_t cleanUnmount;
+} Superblock;
+
+// The whole file system is one image file: the superblock, the inode table,
+// the free-space bitmap, the block checksums and reference counts, then the
+// data blocks. It is mapped twice. Data blocks and checksums are read and
+// written in image, a shared mapping; writes only mark the pages they touch
+// dirty and syncVolume() writes those pages back. Metadata, extent blocks
+// included, is read and changed at base, a private mapping the kernel never
+// writes back; the pages it changes are staged, and checkpointJournal()
+// copies them into image. Both mappings span mappedSize bytes, enough for
+// the volume at its block limit, so growing the image never moves them;
+// size is how much of them the image currently backs.
+typedef struct {
+    int fd;
+    char *base;
+    char *image;
+    size_t size;
+    size_t mappedSize;
+    size_t pageSize;
+    uint64_t *dirtyPages;
+    uint64_t *stagedPages;
+    size_t dirtyWords;
+    pthread_mutex_t dirtyLock;
+    pthread_mutex_t syncLock;
+} Volume;
+
+// Start of the journal file that sits next to the image. Records after it
+// continue from checkpointSequence; older ones already reached the image.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t checkpointSequence;
+} JournalHeader;
+
+// One committed transaction: entryCount entries, each a JournalEntry followed
+// by the new contents of the metadata range it names. checksum covers the
+// record with checksum set to 0 and the entries.
+typedef struct {
+    uint32_t magic;
+    uint32_t checksum;
+    uint64_t sequence;
+    uint32_t length;
+    uint32_t entryCount;
+} JournalRecord;
+
+typedef struct {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t reserved;
+} JournalEntry;
+
+// The metadata a thread changed since beginTransaction, captured by markDirty
+// as the changes are made. Transactions nest; only the outermost commits.
+typedef struct {
+    int depth;
+    char *entries;
+    size_t length;
+    size_t capacity;
+    int entryCount;
+    int overflowed;
+} JournalTransaction;
+
+// Redo journal of metadata changes. A transaction changes metadata at
+// volume.base only, and holds inFlight shared until its record is durable.
+// Checkpoints hold it exclusively while they copy the staged metadata into
+// the image, so the image only ever holds changes whose records are durable
+// and replay has nothing to undo. Committing threads append their record to
+// pending and the first of them to find no write in progress writes out
+// everything pending with one pwrite and one fdatasync, so concurrent
+// commits share a single flush.
+typedef struct {
+    int fd;
+    size_t writeOffset;
+    char *pending;
+    size_t pendingLength;
+    size_t pendingCapacity;
+    char *writing;
+    size_t writingCapacity;
+    uint64_t lastSequence;
+    uint64_t durableSequence;
+    uint64_t failedFrom;
+    uint64_t failedThrough;
+    int flushing;
+    int checkpointWanted;
+    long transactions;
+    long commits;
+    long bytesWritten;
+    long checkpoints;
+    long replayed;
+    pthread_mutex_t lock;
+    pthread_cond_t durable;
+    pthread_rwlock_t inFlight;
+} Journal;
+
+// One cached copy of a data block, or of an expanded block of a compressed
+// unit when block is at or past COMPRESSED_KEY_BASE. Pinned frames are being
+// read or written by a caller and are never evicted or written back. A
+// loading frame is still being filled, without the cache lock, by the thread
+// that missed on it or by an asynchronous read whose transfer has not
+// completed yet. A corrupt frame was loaded from blocks that failed their
+// checksum; it stays cached, so every reader gets the error, until a writer
+// replaces its contents.
+typedef struct {
+    int64_t block;
+    int referenced;
+    int dirty;
+    int pinCount;
+    int loading;
+    int corrupt;
+    int nextInBucket;
+    char data[DATA_BLOCK_SIZE];
+} CacheFrame;
+
+// Fixed-size write-back cache of data blocks between readFile/writeFile and
+// the volume image. Frames are found through a chained hash on the block
+// number and replaced with CLOCK; dirty frames go back to the image when they
+// are evicted or when the flusher thread runs.
+typedef struct {
+    CacheFrame *frames;
+    int buckets[CACHE_BUCKETS];
+    int clockHand;
+    int dirtyCount;
+    long hits;
+    long misses;
+    long evictions;
+    long writebacks;
+    long runReads;
+    long runReadBlocks;
+    long runWrites;
+    long runWriteBlocks;
+    int stopFlusher;
+    pthread_t flusher;
+    pthread_mutex_t lock;
+    pthread_cond_t flushNeeded;
+    pthread_cond_t frameLoaded;
+} BufferCache;
+
+// Writes into holes are buffered until the flusher, fallocate or unmount
+// places them, so a file written in pieces can still get one contiguous run.
+// inodes lists the files with buffered blocks. reserved counts those blocks,
+// and new ones are only buffered while free space can still hold them all.
+typedef struct {
+    int *inodes;
+    int inodeCount;
+    int inodeCapacity;
+    int reserved;
+    long flushes;
+    long placedBlocks;
+    long placedExtents;
+    pthread_mutex_t lock;
+} DelayedAllocation;
+
+// A block holding packed tails. used has a bit per slot.
+typedef struct {
+    int block;
+    uint32_t used;
+} TailBlock;
+
+// Start of the first block of a compressed unit. The compressed bytes follow.
+typedef struct {
+    uint32_t storedLength;
+    uint32_t expandedLength;
+} UnitHeader;
+
+// Compression totals. Units that would not have saved a block are stored as
+// they are and counted in rawUnits.
+typedef struct {
+    long units;
+    long rawUnits;
+    long expandedBlocks;
+    long storedBlocks;
+    long expansions;
+    long compressNs;
+    long expandNs;
+} CompressionStats;
+
+// What compression does for one file: expandedBlocks of its data sit in
+// unitCount compressed units taking storedBlocks. The times are as in
+// InodeState.
+typedef struct {
+    int compressed;
+    int unitCount;
+    int expandedBlocks;
+    int storedBlocks;
+    long compressNs;
+    long expandNs;
+} CompressionReport;
+
+// CRC32C of every data block, in a region of the image indexed by block
+// number like the bitmap. Blocks are sealed whenever markDirty sees them
+// change and checked whenever they are read back from the image. table holds
+// the slicing-by-8 tables for CPUs without SSE4.2.
+typedef struct {
+    uint32_t *sums;
+    int hardware;
+    uint32_t table[8][256];
+    long verifiedBlocks;
+    long failedBlocks;
+} BlockChecksums;
+
+// Background pass over the blocks of every file. nextInode and nextBlock are
+// where the next batch starts.
+typedef struct {
+    int nextInode;
+    int nextBlock;
+    long passes;
+    long scrubbedBlocks;
+    long corruptBlocks;
+    int stop;
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} Scrubber;
+
+// Data blocks owned by more than one file. refs[block] counts the owners past
+// the first, so a block one file owns has 0; it lives in the image after the
+// checksums and changes to it are journaled with the extents that caused
+// them. sharedBlocks and extraReferences are totals over refs. The lock also
+// guards the dedup index.
+typedef struct {
+    uint32_t *refs;
+    long sharedBlocks;
+    long extraReferences;
+    long copiedBlocks;
+    pthread_mutex_t lock;
+} BlockRefs;
+
+typedef struct {
+    uint32_t fingerprint;
+    int block;
+} DedupEntry;
+
+// Fixed-size index from the CRC32C of a block's contents to a block holding
+// them. The fingerprint is only a hint: a candidate is compared in full
+// before it is shared. indexed marks the blocks entries may point at, which
+// are left unchanged until they are written or freed, either of which takes
+// them out; entries for other blocks are stale and get reused. When every
+// slot a fingerprint may use is live, the one at its home slot is replaced.
+typedef struct {
+    DedupEntry entries[DEDUP_INDEX_SLOTS];
+    uint64_t *indexed;
+    long indexedBlocks;
+    long duplicates;
+    long misses;
+    long replaced;
+} DedupIndex;
+
+// Counters for snapshots and file clones. busyWaits counts the times one had
+// to let go of the namespace to wait for a file in use.
+typedef struct {
+    long snapshots;
+    long clonedFiles;
+    long sharedBlocks;
+    long busyWaits;
+} CloneStats;
+
+// Shared tail blocks, rebuilt from the inodes at mount. A block goes back to
+// the allocator once its last tail is gone.
+typedef struct {
+    TailBlock *blocks;
+    int count;
+    int capacity;
+    long inlinedFiles;
+    long packedTails;
+    pthread_mutex_t lock;
+} TailStore;
+
+// A run of physical blocks of one file to load into the buffer cache. The
+// generation lets the worker skip files that were deleted in the meantime.
+typedef struct {
+    int inode;
+    uint32_t generation;
+    int start;
+    int length;
+} ReadaheadRequest;
+
+typedef struct {
+    ReadaheadRequest requests[READAHEAD_QUEUE_SIZE];
+    int head;
+    int count;
+    long queuedBlocks;
+    long loadedBlocks;
+    long droppedRequests;
+    int stop;
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+} ReadaheadQueue;
+
+// Lets path lookups and listings run without fileSystemLock. Writers, which
+// still hold the lock, make sequence odd while they change directories or the
+// dentry cache; readers retry if it moved under them. Memory writers unlink
+// (B-tree nodes, dentry slots and paths) is retired rather than freed, and
+// only released once no reader that could have seen it is left: readers
+// register in the current epoch, and the epoch only advances past one with
+// no readers in it.
+typedef struct {
+    uint32_t sequence;
+    unsigned long epoch;
+    long readers[RECLAIM_EPOCHS];
+    void **retired[RECLAIM_EPOCHS];
+    int retiredCount[RECLAIM_EPOCHS];
+    int retiredCapacity[RECLAIM_EPOCHS];
+    long locklessLookups;
+    long lockedLookups;
+    pthread_mutex_t lock;
+} NamespaceSync;
+
+// A read-only window onto part of a file. Each span points straight at the
+// pinned cache frame holding one block, so nothing is copied; the frames
+// stay valid and unchanged until the view is released.
+typedef struct {
+    int inode;
+    int64_t offset;
+    int length;
+    int spanCount;
+    struct iovec spans[MAX_VIEW_SPANS];
+    CacheFrame *frames[MAX_VIEW_SPANS];
+} FileView;
+
+// An open file. The handle remembers the resolved inode, so calls on it skip
+// path lookup; generation tells whether the file was deleted since. lock
+// guards position.
+typedef struct {
+    int inUse;
+    int inode;
+    uint32_t generation;
+    int mode;
+    int64_t position;
+    pthread_mutex_t lock;
+} OpenFile;
+
+typedef struct {
+    OpenFile *handles;
+    int *freeHandles;
+    int freeCount;
+    pthread_mutex_t lock;
+} HandleTable;
+
+// A run of blocks an asynchronous read is loading through the ring.
+typedef struct {
+    struct IoRequest *request;
+    int first;
+    int count;
+} IoTransfer;
+
+// An asynchronous read or write of a file, with the same meaning and results
+// as readFileInto and writeFile. When it completes, callback runs on an
+// engine thread, or without one the request is handed back by waitForIo.
+// path and buffer must stay valid until then.
+typedef struct IoRequest {
+    int opcode;
+    const char *path;
+    char *buffer;
+    int length;
+    int result;
+    void (*callback)(struct IoRequest *request);
+    void *userData;
+
+    // Owned by the engine while the request is in flight
+    struct IoRequest *next;
+    int inode;
+    int logicalBlock;
+    int copied;
+    int remaining;
+    int pinned;
+    CacheFrame *frames[MAX_IO_RUN];
+    char inserted[MAX_IO_RUN];
+    struct iovec vectors[MAX_IO_RUN];
+    IoTransfer transfers[MAX_IO_RUN];
+} IoRequest;
+
+// The shared rings of an io_uring instance, mapped from the kernel.
+typedef struct {
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+    unsigned unsubmitted;
+} IoRing;
+
+// Runs asynchronous requests. With io_uring one thread keeps every request
+// in flight and loads cache misses through the ring; otherwise a pool of
+// workers runs them synchronously. The queues are guarded by lock; waiting,
+// deferred and the ring belong to the ring thread.
+typedef struct {
+    int running;
+    int useRing;
+    IoRing ring;
+    int eventFd;
+    IoRequest *submitted;
+    IoRequest *submittedTail;
+    IoRequest *completed;
+    IoRequest *completedTail;
+    int pendingCompletions;
+    IoRequest *waiting;
+    IoRequest *deferred;
+    int timeoutArmed;
+    struct __kernel_timespec retryDelay;
+    int stop;
+    pthread_t workers[IO_WORKERS];
+    int workerCount;
+    long ringRequests;
+    long pooledRequests;
+    long ringTransfers;
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    pthread_cond_t completion;
+} IoEngine;
+
+Volume volume;
+Journal journal = {.fd = -1,
+                   .lock = PTHREAD_MUTEX_INITIALIZER,
+                   .durable = PTHREAD_COND_INITIALIZER,
+                   .inFlight = PTHREAD_RWLOCK_INITIALIZER};
+__thread JournalTransaction threadTransaction;
+BufferCache bufferCache;
+DelayedAllocation delayedAllocation = {.lock = PTHREAD_MUTEX_INITIALIZER};
+TailStore tailStore = {.lock = PTHREAD_MUTEX_INITIALIZER};
+CompressionStats compressionStats;
+BlockChecksums checksums;
+Scrubber scrubber = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER};
+BlockRefs blockRefs = {.lock = PTHREAD_MUTEX_INITIALIZER};
+DedupIndex dedupIndex;
+CloneStats cloneStats;
+ReadaheadQueue readaheadQueue;
+NamespaceSync namespaceSync = {.lock = PTHREAD_MUTEX_INITIALIZER};
+IoEngine ioEngine;
+HandleTable handleTable;
+int useIoUring = 1;
+Superblock *superblock;
+InodeTable inodeTable;
+DentryCache dentryCache;
+DataBlock *dataBlocks;
+DataBlock *metadataBlocks;
+const char zeroBlock[DATA_BLOCK_SIZE];
+FreeSpaceBitmap freeSpace;
+int allocationPolicy = ALLOCATION_BEST_FIT;
+__thread int threadMagazine = -1;
+__thread long threadExpandNs;
+
+pthread_mutex_t fileSystemLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Fills the slicing-by-8 tables, where table[k][n] is the CRC of byte n
+// followed by k zero bytes, and picks the crc32 instruction when the CPU has
+// SSE4.2.
+void initializeChecksums() {
+    for (int n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+        }
+        checksums.table[0][n] = crc;
+    }
+    for (int n = 0; n < 256; n++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t previous = checksums.table[k - 1][n];
+            checksums.table[k][n] = (previous >> 8) ^ checksums.table[0][previous & 0xff];
+        }
+    }
+#if defined(__x86_64__)
+    checksums.hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+// Eight bytes per step through the tables, read as little-endian words.
+uint32_t crc32cSoftware(uint32_t crc, const char *bytes, int length) {
+    const unsigned char *input = (const unsigned char *) bytes;
+    uint32_t (*table)[256] = checksums.table;
+    int i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint32_t low = input[i] | input[i + 1] << 8 | input[i + 2] << 16 | (uint32_t) input[i + 3] << 24;
+        uint32_t high = input[i + 4] | input[i + 5] << 8 | input[i + 6] << 16 | (uint32_t) input[i + 7] << 24;
+        low ^= crc;
+        crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^ table[5][(low >> 16) & 0xff] ^
+              table[4][low >> 24] ^ table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^
+              table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+    }
+    for (; i < length; i++) {
+        crc = table[0][(crc ^ input[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// Eight bytes per crc32 instruction.
+__attribute__((target("sse4.2"))) uint32_t crc32cHardware(uint32_t crc, const char *bytes, int length) {
+    uint64_t value = crc;
+    int i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        value = __builtin_ia32_crc32di(value, word);
+    }
+    crc = value;
+    for (; i < length; i++) {
+        crc = __builtin_ia32_crc32qi(crc, bytes[i]);
+    }
+    return crc;
+}
+#endif
+
+uint32_t crc32c(const char *bytes, int length) {
+#if defined(__x86_64__)
+    if (checksums.hardware) {
+        return ~crc32cHardware(~0u, bytes, length);
+    }
+#endif
+    return ~crc32cSoftware(~0u, bytes, length);
+}
+
+// Sets the bits of the pages under [offset, offset + length) in pages, the
+// dirty or staged page map.
+void markPages(uint64_t *pages, size_t offset, size_t length) {
+    size_t firstPage = offset / volume.pageSize;
+    size_t lastPage = (offset + length - 1) / volume.pageSize;
+
+    pthread_mutex_lock(&volume.dirtyLock);
+    for (size_t page = firstPage; page <= lastPage; page++) {
+        pages[page / 64] |= 1ULL << (page % 64);
+    }
+    pthread_mutex_unlock(&volume.dirtyLock);
+}
+
+// Marks the pages of the image under [address, address + length) for
+// syncVolume.
+void markPagesDirty(void *address, size_t length) {
+    markPages(volume.dirtyPages, (char *) address - volume.image, length);
+}
+
+// Stages the pages of a metadata range changed at base for the next
+// checkpoint, and copies the range's new contents into the calling thread's
+// transaction.
+void journalRange(void *address, size_t length) {
+    JournalTransaction *transaction = &threadTransaction;
+    size_t offset = (char *) address - volume.base;
+    markPages(volume.stagedPages, offset, length);
+    if (transaction->depth == 0 || transaction->overflowed) {
+        return;
+    }
+
+    size_t needed = transaction->length + sizeof(JournalEntry) + length;
+    if (needed > transaction->capacity) {
+        size_t capacity = (transaction->capacity > 0) ? transaction->capacity : 1024;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        char *entries = realloc(transaction->entries, capacity);
+        if (entries == NULL) {
+            transaction->overflowed = 1;
+            return;
+        }
+        transaction->entries = entries;
+        transaction->capacity = capacity;
+    }
+
+    JournalEntry entry = {.offset = offset, .length = length};
+    memcpy(transaction->entries + transaction->length, &entry, sizeof(entry));
+    memcpy(transaction->entries + transaction->length + sizeof(entry), address, length);
+    transaction->length = needed;
+    transaction->entryCount++;
+}
+
+// Stores the checksums of count blocks from first on as they are now.
+void sealBlocks(int first, int count) {
+    for (int block = first; block < first + count; block++) {
+        checksums.sums[block] = crc32c(dataBlocks[block].data, DATA_BLOCK_SIZE);
+    }
+    markPagesDirty(&checksums.sums[first], count * sizeof(uint32_t));
+}
+
+// Seals blocks known to be zeroed, as new ones are, without reading them.
+void sealZeroBlocks(int first, int count) {
+    uint32_t sum = crc32c(zeroBlock, DATA_BLOCK_SIZE);
+    for (int block = first; block < first + count; block++) {
+        checksums.sums[block] = sum;
+    }
+    markPagesDirty(&checksums.sums[first], count * sizeof(uint32_t));
+}
+
+// Whether data, a copy of block, matches the block's checksum.
+int blockIntact(int block, const char *data) {
+    int intact = crc32c(data, DATA_BLOCK_SIZE) == checksums.sums[block];
+    __atomic_fetch_add(intact ? &checksums.verifiedBlocks : &checksums.failedBlocks, 1, __ATOMIC_RELAXED);
+    return intact;
+}
+
+// Records that [address, address + length) was modified. Metadata, changed
+// at base, is journaled; data blocks, changed in the image, are sealed with
+// their new checksums.
+void markDirty(void *address, size_t length) {
+    if ((char *) address >= volume.base && (char *) address < volume.base + volume.mappedSize) {
+        journalRange(address, length);
+        return;
+    }
+
+    size_t offset = (char *) address - volume.image;
+    if (offset >= superblock->dataRegionOffset) {
+        int first = (offset - superblock->dataRegionOffset) / DATA_BLOCK_SIZE;
+        int last = (offset + length - 1 - superblock->dataRegionOffset) / DATA_BLOCK_SIZE;
+        sealBlocks(first, last - first + 1);
+    }
+    markPagesDirty(address, length);
+}
+
+// Writes back every dirty page, one msync per run of adjacent dirty pages.
+// Syncs are serialized, so once this returns every page dirtied before the
+// call has been written, even ones a concurrent sync had already picked up.
+int syncVolume() {
+    pthread_mutex_lock(&volume.syncLock);
+    pthread_mutex_lock(&volume.dirtyLock);
+    uint64_t *dirtyPages = malloc(volume.dirtyWords * sizeof(uint64_t));
+    if (dirtyPages == NULL) {
+        pthread_mutex_unlock(&volume.dirtyLock);
+        pthread_mutex_unlock(&volume.syncLock);
+        return -1;
+    }
+    memcpy(dirtyPages, volume.dirtyPages, volume.dirtyWords * sizeof(uint64_t));
+    memset(volume.dirtyPages, 0, volume.dirtyWords * sizeof(uint64_t));
+    pthread_mutex_unlock(&volume.dirtyLock);
+
+    int errorCode = 0;
+    size_t page = 0;
+    size_t pageCount = volume.dirtyWords * 64;
+    while (page < pageCount) {
+        uint64_t word = dirtyPages[page / 64] >> (page % 64);
+        if (word == 0) {
+            page = (page / 64 + 1) * 64;
+            continue;
+        }
+        page += __builtin_ctzll(word);
+
+        size_t runStart = page;
+        while (page < pageCount && (dirtyPages[page / 64] & (1ULL << (page % 64)))) {
+            page++;
+        }
+
+        size_t offset = runStart * volume.pageSize;
+        size_t length = (page - runStart) * volume.pageSize;
+        if (offset + length > volume.size) {
+            length = volume.size - offset;
+        }
+        if (msync(volume.image + offset, length, MS_SYNC) != 0) {
+            markPagesDirty(volume.image + offset, length);
+            errorCode = -1;
+        }
+    }
+
+    free(dirtyPages);
+    pthread_mutex_unlock(&volume.syncLock);
+    return errorCode;
+}
+
+// Maps the image open on fd, size bytes long, twice into mappedSize bytes of
+// address space and points the region globals at the offsets recorded in its
+// superblock. Nothing past size may be touched until the image grows.
+int mapVolume(int fd, size_t size, size_t mappedSize) {
+    volume.fd = fd;
+    volume.size = size;
+    volume.mappedSize = mappedSize;
+    volume.image = mmap(NULL, volume.mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, volume.fd, 0);
+    if (volume.image == MAP_FAILED) {
+        return -1;
+    }
+    volume.base =
+        mmap(NULL, volume.mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, volume.fd, 0);
+    if (volume.base == MAP_FAILED) {
+        munmap(volume.image, volume.mappedSize);
+        return -1;
+    }
+
+    volume.pageSize = sysconf(_SC_PAGESIZE);
+    size_t pageCount = (volume.mappedSize + volume.pageSize - 1) / volume.pageSize;
+    volume.dirtyWords = (pageCount + 63) / 64;
+    volume.dirtyPages = calloc(volume.dirtyWords, sizeof(uint64_t));
+    volume.stagedPages = calloc(volume.dirtyWords, sizeof(uint64_t));
+    if (volume.dirtyPages == NULL || volume.stagedPages == NULL) {
+        free(volume.dirtyPages);
+        free(volume.stagedPages);
+        munmap(volume.base, volume.mappedSize);
+        munmap(volume.image, volume.mappedSize);
+        return -1;
+    }
+    pthread_mutex_init(&volume.dirtyLock, NULL);
+    pthread_mutex_init(&volume.syncLock, NULL);
+
+    superblock = (Superblock *) volume.base;
+    inodeTable.inodes = (FileMetadata *) (volume.base + superblock->inodeRegionOffset);
+    freeSpace.freeMap = (uint64_t *) (volume.base + superblock->bitmapRegionOffset);
+    checksums.sums = (uint32_t *) (volume.image + superblock->checksumRegionOffset);
+    blockRefs.refs = (uint32_t *) (volume.base + superblock->refcountRegionOffset);
+    dataBlocks = (DataBlock *) (volume.image + superblock->dataRegionOffset);
+    metadataBlocks = (DataBlock *) (volume.base + superblock->dataRegionOffset);
+    return 0;
+}
+
+void closeJournal();
+
+void unmapVolume() {
+    closeJournal();
+    munmap(volume.base, volume.mappedSize);
+    munmap(volume.image, volume.mappedSize);
+    close(volume.fd);
+    free(volume.dirtyPages);
+    free(volume.stagedPages);
+}
+
+// Reserves address space for count elements of size bytes, zero-filled.
+// Pages only take memory once touched, so a table reserved for its limit
+// grows in place and pointers into it stay valid while it does.
+void *reserveArena(size_t count, size_t size) {
+    void *arena = mmap(NULL, count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return (arena == MAP_FAILED) ? NULL : arena;
+}
+
+void releaseArena(void *arena, size_t count, size_t size) {
+    if (arena != NULL) {
+        munmap(arena, count * size);
+    }
+}
+
+// Places the regions of a volume with the limits in layout. The inode table,
+// bitmap, checksums and reference counts get room for the limits up front;
+// the image is sparse, so room not in use yet takes no space on disk.
+void layOutVolume(Superblock *layout) {
+    layout->inodeRegionOffset = SUPERBLOCK_SIZE;
+    layout->bitmapRegionOffset = layout->inodeRegionOffset + (uint64_t) layout->inodeLimit * sizeof(FileMetadata);
+    layout->checksumRegionOffset =
+        layout->bitmapRegionOffset + BITMAP_WORDS(layout->blockLimit) * sizeof(uint64_t);
+    layout->refcountRegionOffset =
+        layout->checksumRegionOffset + (uint64_t) layout->blockLimit * sizeof(uint32_t);
+    uint64_t refcountEnd = layout->refcountRegionOffset + (uint64_t) layout->blockLimit * sizeof(uint32_t);
+    layout->dataRegionOffset = (refcountEnd + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE * DATA_BLOCK_SIZE;
+    layout->volumeSize = layout->dataRegionOffset + (uint64_t) layout->blockCount * DATA_BLOCK_SIZE;
+}
+
+// Whether this build can mount the volume described by stored from an image
+// of imageSize bytes.
+int validGeometry(const Superblock *stored, size_t imageSize) {
+    Superblock layout = *stored;
+    layOutVolume(&layout);
+    return stored->blockSize == DATA_BLOCK_SIZE && stored->inodeSize == sizeof(FileMetadata) &&
+           stored->blockCount > 0 && stored->blockCount <= stored->blockLimit &&
+           stored->blockLimit <= INT32_MAX / 2 && stored->inodeCapacity > 0 &&
+           stored->inodeCapacity <= stored->inodeLimit && stored->inodeLimit <= INT32_MAX / 2 &&
+           stored->inodeHighWater <= stored->inodeCapacity &&
+           layout.inodeRegionOffset == stored->inodeRegionOffset &&
+           layout.bitmapRegionOffset == stored->bitmapRegionOffset &&
+           layout.checksumRegionOffset == stored->checksumRegionOffset &&
+           layout.refcountRegionOffset == stored->refcountRegionOffset &&
+           layout.dataRegionOffset == stored->dataRegionOffset && layout.volumeSize == stored->volumeSize &&
+           stored->volumeSize <= imageSize;
+}
+
+// Bytes of address space a volume needs at its block limit.
+size_t mappingSize(const Superblock *layout) {
+    return layout->dataRegionOffset + (size_t) layout->blockLimit * DATA_BLOCK_SIZE;
+}
+
+uint32_t hashBytes(uint32_t hash, const char *bytes, int length);
+
+// Copies [start, end) of base into the image, for syncVolume to write back.
+void copyToImage(size_t start, size_t end) {
+    if (start < end) {
+        memcpy(volume.image + start, volume.base + start, end - start);
+        markPagesDirty(volume.image + start, end - start);
+    }
+}
+
+// Copies the staged metadata pages from base into the image, leaving out the
+// checksums, which only ever change in the image. Extent blocks are copied
+// and sealed whole, and only while they still hold a file's extents, as a
+// block given back since then may hold data by now. Called with inFlight
+// held exclusively. Returns 0 or -1.
+int copyStagedMetadata() {
+    uint64_t *staged = malloc(volume.dirtyWords * sizeof(uint64_t));
+    if (staged == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&volume.dirtyLock);
+    memcpy(staged, volume.stagedPages, volume.dirtyWords * sizeof(uint64_t));
+    memset(volume.stagedPages, 0, volume.dirtyWords * sizeof(uint64_t));
+    pthread_mutex_unlock(&volume.dirtyLock);
+
+    size_t metadataEnd = superblock->dataRegionOffset;
+    for (size_t page = 0; page * volume.pageSize < metadataEnd; page++) {
+        if (staged[page / 64] == 0) {
+            page = (page / 64 + 1) * 64 - 1;
+            continue;
+        }
+        if (staged[page / 64] & (1ULL << (page % 64))) {
+            size_t start = page * volume.pageSize;
+            size_t end = (start + volume.pageSize < metadataEnd) ? start + volume.pageSize : metadataEnd;
+            copyToImage(start, (end < superblock->checksumRegionOffset) ? end : superblock->checksumRegionOffset);
+            copyToImage((start > superblock->refcountRegionOffset) ? start : superblock->refcountRegionOffset, end);
+        }
+    }
+
+    // The scrubber checks blocks against their checksums under the cache lock
+    for (int i = 0; i < inodeTable.inodeCount; i++) {
+        FileMetadata *file = &inodeTable.inodes[i];
+        size_t page = (metadataEnd + (size_t) file->extentBlock * DATA_BLOCK_SIZE) / volume.pageSize;
+        if (file->inUse && file->extentCount > MAX_EXTENTS && (staged[page / 64] & (1ULL << (page % 64)))) {
+            pthread_mutex_lock(&bufferCache.lock);
+            memcpy(&dataBlocks[file->extentBlock], &metadataBlocks[file->extentBlock], DATA_BLOCK_SIZE);
+            markDirty(&dataBlocks[file->extentBlock], DATA_BLOCK_SIZE);
+            pthread_mutex_unlock(&bufferCache.lock);
+        }
+    }
+    free(staged);
+    return 0;
+}
+
+// Brings the image up to date with every committed transaction and starts
+// the journal over. Waits for a moment with no transaction open, so every
+// change at base is in a durable record by the time it is copied. Returns 0
+// or -1.
+int checkpointJournal() {
+    pthread_rwlock_wrlock(&journal.inFlight);
+    int errorCode = (copyStagedMetadata() == 0 && syncVolume() == 0) ? 0 : -1;
+    if (errorCode == 0 && journal.fd >= 0) {
+        JournalHeader header = {.magic = JOURNAL_MAGIC,
+                                .version = JOURNAL_VERSION,
+                                .checkpointSequence = journal.lastSequence};
+        if (pwrite(journal.fd, &header, sizeof(header), 0) != sizeof(header) || fdatasync(journal.fd) != 0) {
+            errorCode = -1;
+        } else {
+            pthread_mutex_lock(&journal.lock);
+            journal.writeOffset = JOURNAL_HEADER_SIZE;
+            journal.failedFrom = 0;
+            journal.failedThrough = 0;
+            journal.checkpointWanted = 0;
+            journal.checkpoints++;
+            pthread_mutex_unlock(&journal.lock);
+        }
+    }
+    pthread_rwlock_unlock(&journal.inFlight);
+    return errorCode;
+}
+
+// Whether the journal has grown past JOURNAL_CHECKPOINT_SIZE, or holds a gap
+// or changes too large to record that only a checkpoint puts in the image.
+int checkpointDue() {
+    pthread_mutex_lock(&journal.lock);
+    int due = journal.fd >= 0 && (journal.writeOffset >= JOURNAL_CHECKPOINT_SIZE || journal.checkpointWanted);
+    pthread_mutex_unlock(&journal.lock);
+    return due;
+}
+
+// Writes out every pending record. Called with journal.lock held and no
+// flush in progress; the lock is dropped during the I/O so other threads can
+// queue the next batch meanwhile.
+void flushJournal() {
+    journal.flushing = 1;
+    char *batch = journal.pending;
+    size_t batchLength = journal.pendingLength;
+    size_t batchCapacity = journal.pendingCapacity;
+    journal.pending = journal.writing;
+    journal.pendingCapacity = journal.writingCapacity;
+    journal.pendingLength = 0;
+    journal.writing = batch;
+    journal.writingCapacity = batchCapacity;
+    uint64_t first = journal.durableSequence + 1;
+    uint64_t last = journal.lastSequence;
+    size_t writeOffset = journal.writeOffset;
+    int broken = journal.failedThrough >= first;
+    pthread_mutex_unlock(&journal.lock);
+
+    // Checkpoints cannot run while the committing threads hold inFlight, so
+    // the journal grows past JOURNAL_CHECKPOINT_SIZE until the flusher thread
+    // gets to one
+    int written = !broken && pwrite(journal.fd, batch, batchLength, writeOffset) == (ssize_t) batchLength &&
+                  fdatasync(journal.fd) == 0;
+
+    pthread_mutex_lock(&journal.lock);
+    journal.durableSequence = last;
+    journal.commits++;
+    if (written) {
+        journal.writeOffset += batchLength;
+        journal.bytesWritten += batchLength;
+    } else {
+        // Replay stops at the first missing record, so every later batch
+        // fails too until a checkpoint puts the image past this one
+        journal.failedFrom = broken ? journal.failedFrom : first;
+        journal.failedThrough = UINT64_MAX;
+        journal.checkpointWanted = 1;
+    }
+    journal.flushing = 0;
+    pthread_cond_broadcast(&journal.durable);
+}
+
+// Appends a record of the transaction's entries and waits until it is on
+// disk. Returns -1 if it could not be written.
+int appendRecord(JournalTransaction *transaction) {
+    size_t recordLength = sizeof(JournalRecord) + transaction->length;
+    uint32_t entriesHash = hashBytes(2166136261u, transaction->entries, transaction->length);
+
+    pthread_mutex_lock(&journal.lock);
+    if (journal.pendingLength + recordLength > journal.pendingCapacity) {
+        size_t capacity = (journal.pendingCapacity > 0) ? journal.pendingCapacity : 64 * 1024;
+        while (capacity < journal.pendingLength + recordLength) {
+            capacity *= 2;
+        }
+        char *pending = realloc(journal.pending, capacity);
+        if (pending == NULL) {
+            pthread_mutex_unlock(&journal.lock);
+            return -1;
+        }
+        journal.pending = pending;
+        journal.pendingCapacity = capacity;
+    }
+
+    JournalRecord record = {.magic = JOURNAL_RECORD_MAGIC,
+                            .sequence = ++journal.lastSequence,
+                            .length = transaction->length,
+                            .entryCount = transaction->entryCount};
+    record.checksum = hashBytes(entriesHash, (const char *) &record, sizeof(record));
+    memcpy(journal.pending + journal.pendingLength, &record, sizeof(record));
+    memcpy(journal.pending + journal.pendingLength + sizeof(record), transaction->entries, transaction->length);
+    journal.pendingLength += recordLength;
+    journal.transactions++;
+
+    while (journal.durableSequence < record.sequence) {
+        if (journal.flushing) {
+            pthread_cond_wait(&journal.durable, &journal.lock);
+        } else {
+            flushJournal();
+        }
+    }
+    int errorCode = (record.sequence >= journal.failedFrom && record.sequence <= journal.failedThrough) ? -1 : 0;
+    pthread_mutex_unlock(&journal.lock);
+    return errorCode;
+}
+
+// Opens a transaction, or nests one in the calling thread's open one.
+// Checkpoints wait until no thread has one open.
+void beginTransaction() {
+    if (threadTransaction.depth++ == 0) {
+        pthread_rwlock_rdlock(&journal.inFlight);
+    }
+}
+
+// Makes the metadata changes of the outermost transaction durable. Returns 0
+// or -1 if they could not be written.
+int commitTransaction() {
+    JournalTransaction *transaction = &threadTransaction;
+    if (--transaction->depth > 0) {
+        return 0;
+    }
+
+    int errorCode = 0;
+    if (journal.fd < 0) {
+        errorCode = 0;
+    } else if (transaction->overflowed) {
+        // Too large to record, so it reaches the image with the next checkpoint
+        pthread_mutex_lock(&journal.lock);
+        journal.checkpointWanted = 1;
+        pthread_mutex_unlock(&journal.lock);
+    } else if (transaction->entryCount > 0) {
+        errorCode = appendRecord(transaction);
+    }
+
+    free(transaction->entries);
+    memset(transaction, 0, sizeof(JournalTransaction));
+    pthread_rwlock_unlock(&journal.inFlight);
+    if (errorCode != 0) {
+        printf("Error: Failed to commit metadata to the journal.\n");
+    }
+    return errorCode;
+}
+
+// Applies a record's entries to the image. Returns -1 if one points outside
+// it.
+int applyRecord(const char *entries, const JournalRecord *record) {
+    size_t position = 0;
+    for (uint32_t i = 0; i < record->entryCount; i++) {
+        JournalEntry entry;
+        if (position + sizeof(entry) > record->length) {
+            return -1;
+        }
+        memcpy(&entry, entries + position, sizeof(entry));
+        position += sizeof(entry);
+        if (entry.length > record->length - position || entry.offset + entry.length > volume.size) {
+            return -1;
+        }
+        memcpy(volume.image + entry.offset, entries + position, entry.length);
+        markDirty(volume.image + entry.offset, entry.length);
+        position += entry.length;
+    }
+    return 0;
+}
+
+// Applies every committed record after the last checkpoint, in order, up to
+// the first missing or torn one, then checkpoints so the journal is empty.
+// Returns how many transactions were replayed.
+int replayJournal() {
+    JournalHeader header;
+    uint64_t sequence = 0;
+    size_t offset = JOURNAL_HEADER_SIZE;
+    int replayed = 0;
+
+    if (pread(journal.fd, &header, sizeof(header), 0) == sizeof(header) && header.magic == JOURNAL_MAGIC &&
+        header.version == JOURNAL_VERSION) {
+        sequence = header.checkpointSequence;
+        while (1) {
+            JournalRecord record;
+            if (pread(journal.fd, &record, sizeof(record), offset) != sizeof(record) ||
+                record.magic != JOURNAL_RECORD_MAGIC || record.sequence != sequence + 1 ||
+                record.length > JOURNAL_CHECKPOINT_SIZE) {
+                break;
+            }
+
+            char *entries = malloc(record.length > 0 ? record.length : 1);
+            if (entries == NULL) {
+                break;
+            }
+            uint32_t checksum = record.checksum;
+            record.checksum = 0;
+            int valid = pread(journal.fd, entries, record.length, offset + sizeof(record)) == (ssize_t) record.length &&
+                        hashBytes(hashBytes(2166136261u, entries, record.length), (const char *) &record,
+                                  sizeof(record)) == checksum;
+            if (!valid || applyRecord(entries, &record) != 0) {
+                free(entries);
+                break;
+            }
+            free(entries);
+
+            sequence++;
+            replayed++;
+            offset += sizeof(record) + record.length;
+        }
+    }
+
+    journal.lastSequence = sequence;
+    journal.durableSequence = sequence;
+    journal.replayed = replayed;
+    if (checkpointJournal() != 0) {
+        return -1;
+    }
+    return replayed;
+}
+
+// Opens the journal next to the image at path, starting a new one if create
+// is set. Returns 0 or -1.
+int openJournal(const char *path, int create) {
+    char journalPath[MAX_PATH_LENGTH];
+    if (snprintf(journalPath, sizeof(journalPath), "%s.journal", path) >= (int) sizeof(journalPath)) {
+        return -1;
+    }
+
+    journal.fd = open(journalPath, O_RDWR | O_CREAT | (create ? O_TRUNC : 0), 0644);
+    if (journal.fd < 0) {
+        return -1;
+    }
+    journal.writeOffset = JOURNAL_HEADER_SIZE;
+    journal.pendingLength = 0;
+    journal.lastSequence = 0;
+    journal.durableSequence = 0;
+    journal.failedFrom = 0;
+    journal.failedThrough = 0;
+    journal.checkpointWanted = 0;
+    journal.transactions = 0;
+    journal.commits = 0;
+    journal.bytesWritten = 0;
+    journal.checkpoints = 0;
+    journal.replayed = 0;
+    return 0;
+}
+
+void closeJournal() {
+    if (journal.fd < 0) {
+        return;
+    }
+    close(journal.fd);
+    journal.fd = -1;
+    free(journal.pending);
+    free(journal.writing);
+    journal.pending = NULL;
+    journal.writing = NULL;
+    journal.pendingCapacity = 0;
+    journal.writingCapacity = 0;
+}
+
+void printJournalStats() {
+    pthread_mutex_lock(&journal.lock);
+    printf("Journal: %ld transactions in %ld commits, %ld bytes written, %ld checkpoints, %ld replayed at mount\n",
+           journal.transactions, journal.commits, journal.bytesWritten, journal.checkpoints, journal.replayed);
+    pthread_mutex_unlock(&journal.lock);
+}
+
+// Marks the start and end of a namespace change. Called with fileSystemLock
+// held; the two calls must not nest.
+void beginNamespaceWrite() {
+    __atomic_store_n(&namespaceSync.sequence, namespaceSync.sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void reclaimMemory();
+int startIoEngine();
+void stopIoEngine();
+int startHandleTable();
+void stopHandleTable();
+int flushAllDelayed();
+int startScrubber();
+void stopScrubber();
+
+void endNamespaceWrite() {
+    __atomic_store_n(&namespaceSync.sequence, namespaceSync.sequence + 1, __ATOMIC_RELEASE);
+    reclaimMemory();
+}
+
+// Returns the epoch the caller registered in, to be passed to leaveReader.
+unsigned long enterReader() {
+    while (1) {
+        unsigned long epoch = __atomic_load_n(&namespaceSync.epoch, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&namespaceSync.readers[epoch % RECLAIM_EPOCHS], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&namespaceSync.epoch, __ATOMIC_SEQ_CST) == epoch) {
+            return epoch;
+        }
+        __atomic_fetch_sub(&namespaceSync.readers[epoch % RECLAIM_EPOCHS], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void leaveReader(unsigned long epoch) {
+    __atomic_fetch_sub(&namespaceSync.readers[epoch % RECLAIM_EPOCHS], 1, __ATOMIC_RELEASE);
+}
+
+// Frees pointer once no lock-free reader can still be looking at it.
+void retireMemory(void *pointer) {
+    if (pointer == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&namespaceSync.lock);
+    int bucket = namespaceSync.epoch % RECLAIM_EPOCHS;
+    if (namespaceSync.retiredCount[bucket] == namespaceSync.retiredCapacity[bucket]) {
+        int capacity = (namespaceSync.retiredCapacity[bucket] > 0) ? namespaceSync.retiredCapacity[bucket] * 2 : 64;
+        void **retired = realloc(namespaceSync.retired[bucket], capacity * sizeof(void *));
+        if (retired == NULL) {
+            // Leaking is safe; freeing early is not
+            pthread_mutex_unlock(&namespaceSync.lock);
+            return;
+        }
+        namespaceSync.retired[bucket] = retired;
+        namespaceSync.retiredCapacity[bucket] = capacity;
+    }
+    namespaceSync.retired[bucket][namespaceSync.retiredCount[bucket]++] = pointer;
+    pthread_mutex_unlock(&namespaceSync.lock);
+}
+
+void freeRetired(int bucket) {
+    for (int i = 0; i < namespaceSync.retiredCount[bucket]; i++) {
+        free(namespaceSync.retired[bucket][i]);
+    }
+    namespaceSync.retiredCount[bucket] = 0;
+}
+
+// Advances the epoch if every reader of the previous one has left, then
+// frees what was retired two epochs ago. Never waits for readers.
+void reclaimMemory() {
+    pthread_mutex_lock(&namespaceSync.lock);
+    unsigned long epoch = namespaceSync.epoch;
+    int previous = (epoch + RECLAIM_EPOCHS - 1) % RECLAIM_EPOCHS;
+    if (__atomic_load_n(&namespaceSync.readers[previous], __ATOMIC_SEQ_CST) == 0) {
+        __atomic_store_n(&namespaceSync.epoch, epoch + 1, __ATOMIC_SEQ_CST);
+        freeRetired(previous);
+    }
+    pthread_mutex_unlock(&namespaceSync.lock);
+}
+
+// CPU time the calling thread has used so far.
+long threadCpuNs() {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+// Appends the part of a length that did not fit in its token field, as bytes
+// that are 255 up to the last.
+int putLength(unsigned char *output, int position, int length) {
+    for (; length >= 255; length -= 255) {
+        output[position++] = 255;
+    }
+    output[position++] = length;
+    return position;
+}
+
+// Appends one sequence: literalCount literals, then unless matchLength is 0 a
+// match of matchLength bytes starting offset bytes back. Returns the new end
+// of output, or -1 if it would pass capacity.
+int putSequence(unsigned char *output, int position, int capacity, const char *literals, int literalCount,
+                int offset, int matchLength) {
+    int needed = 1 + literalCount / 255 + 1 + literalCount + 2 + matchLength / 255 + 1;
+    if (position + needed > capacity) {
+        return -1;
+    }
+
+    int extra = (matchLength > 0) ? matchLength - COMPRESSION_MIN_MATCH : 0;
+    output[position++] = ((literalCount < 15) ? literalCount : 15) << 4 | ((extra < 15) ? extra : 15);
+    if (literalCount >= 15) {
+        position = putLength(output, position, literalCount - 15);
+    }
+    memcpy(output + position, literals, literalCount);
+    position += literalCount;
+    if (matchLength > 0) {
+        output[position++] = offset & 0xff;
+        output[position++] = offset >> 8;
+        if (extra >= 15) {
+            position = putLength(output, position, extra - 15);
+        }
+    }
+    return position;
+}
+
+// LZ77 laid out like LZ4: each sequence is a token holding two 4-bit
+// lengths, the literals, then a 16-bit offset back to the match. Matches are
+// found through a hash of the next 4 bytes, and the last sequence has no
+// match. Returns the compressed length, or -1 if it would not fit in
+// capacity.
+int compressBytes(const char *input, int length, char *output, int capacity) {
+    int table[1 << COMPRESSION_HASH_BITS];
+    memset(table, -1, sizeof(table));
+
+    int anchor = 0;
+    int position = 0;
+    int written = 0;
+    while (position + COMPRESSION_MIN_MATCH <= length) {
+        uint32_t sequence;
+        memcpy(&sequence, input + position, sizeof(sequence));
+        uint32_t hash = (sequence * 2654435761u) >> (32 - COMPRESSION_HASH_BITS);
+        int candidate = table[hash];
+        table[hash] = position;
+        if (candidate < 0 || position - candidate > COMPRESSION_MAX_OFFSET ||
+            memcmp(input + candidate, input + position, COMPRESSION_MIN_MATCH) != 0) {
+            position++;
+            continue;
+        }
+
+        int matchLength = COMPRESSION_MIN_MATCH;
+        while (position + matchLength < length && input[candidate + matchLength] == input[position + matchLength]) {
+            matchLength++;
+        }
+        written = putSequence((unsigned char *) output, written, capacity, input + anchor, position - anchor,
+                              position - candidate, matchLength);
+        if (written < 0) {
+            return -1;
+        }
+        position += matchLength;
+        anchor = position;
+    }
+    return putSequence((unsigned char *) output, written, capacity, input + anchor, length - anchor, 0, 0);
+}
+
+// Adds the continuation bytes of a length to value. Returns -1 if the input
+// ends first.
+int getLength(const unsigned char *input, int length, int *position, int *value) {
+    unsigned char byte;
+    do {
+        if (*position == length) {
+            return -1;
+        }
+        byte = input[(*position)++];
+        *value += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+// Reverses compressBytes. Returns the expanded length, or -1 if input is
+// malformed or would expand past capacity.
+int expandBytes(const char *input, int length, char *output, int capacity) {
+    const unsigned char *bytes = (const unsigned char *) input;
+    int position = 0;
+    int written = 0;
+    while (position < length) {
+        int token = bytes[position++];
+        int literalCount = token >> 4;
+        if (literalCount == 15 && getLength(bytes, length, &position, &literalCount) != 0) {
+            return -1;
+        }
+        if (literalCount > length - position || literalCount > capacity - written) {
+            return -1;
+        }
+        memcpy(output + written, input + position, literalCount);
+        position += literalCount;
+        written += literalCount;
+        if (position == length) {
+            break;
+        }
+
+        if (length - position < 2) {
+            return -1;
+        }
+        int offset = bytes[position] | bytes[position + 1] << 8;
+        position += 2;
+        int matchLength = token & 15;
+        if (matchLength == 15 && getLength(bytes, length, &position, &matchLength) != 0) {
+            return -1;
+        }
+        matchLength += COMPRESSION_MIN_MATCH;
+        if (offset == 0 || offset > written || matchLength > capacity - written) {
+            return -1;
+        }
+
+        // Byte by byte, since a match may overlap what it produces
+        for (int i = 0; i < matchLength; i++, written++) {
+            output[written] = output[written - offset];
+        }
+    }
+    return written;
+}
+
+// Expands the compressed unit stored from block start into unit, which has
+// room for COMPRESSION_UNIT_SIZE bytes, zero-filling past its end. Returns
+// the expanded length, or -1 with unit zeroed if a stored block fails its
+// checksum or the unit does not decode.
+int expandUnit(int start, char *unit) {
+    long started = threadCpuNs();
+    UnitHeader header;
+    memcpy(&header, dataBlocks[start].data, sizeof(header));
+
+    int expanded = -1;
+    int storedBlocks = (sizeof(UnitHeader) + header.storedLength + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+    int intact = blockIntact(start, dataBlocks[start].data) && header.storedLength <= COMPRESSION_UNIT_SIZE &&
+                 header.expandedLength <= COMPRESSION_UNIT_SIZE &&
+                 start + storedBlocks <= (int) superblock->blockCount;
+    for (int i = 1; intact && i < storedBlocks; i++) {
+        intact = blockIntact(start + i, dataBlocks[start + i].data);
+    }
+    if (intact) {
+        expanded = expandBytes(dataBlocks[start].data + sizeof(UnitHeader), header.storedLength, unit,
+                               header.expandedLength);
+    }
+    if (expanded == (int) header.expandedLength) {
+        memset(unit + expanded, 0, COMPRESSION_UNIT_SIZE - expanded);
+    } else {
+        memset(unit, 0, COMPRESSION_UNIT_SIZE);
+        expanded = -1;
+    }
+
+    long elapsed = threadCpuNs() - started;
+    threadExpandNs += elapsed;
+    __atomic_fetch_add(&compressionStats.expansions, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&compressionStats.expandNs, elapsed, __ATOMIC_RELAXED);
+    return expanded;
+}
+
+// Copies a dirty frame back into the mapping. Called with the cache lock held.
+void writeBackFrame(CacheFrame *frame) {
+    memcpy(dataBlocks[frame->block].data, frame->data, DATA_BLOCK_SIZE);
+    markDirty(&dataBlocks[frame->block], DATA_BLOCK_SIZE);
+    frame->dirty = 0;
+    bufferCache.dirtyCount--;
+    bufferCache.writebacks++;
+}
+
+// Copies the frames, which cache consecutive blocks, back into the mapping
+// and marks the run dirty once, so syncVolume msyncs it as one range. Called
+// with the cache lock held.
+void writeBackFrames(int *frameIndexes, int count) {
+    int first = bufferCache.frames[frameIndexes[0]].block;
+    for (int i = 0; i < count; i++) {
+        memcpy(dataBlocks[first + i].data, bufferCache.frames[frameIndexes[i]].data, DATA_BLOCK_SIZE);
+    }
+    bufferCache.runWrites++;
+    bufferCache.runWriteBlocks += count;
+
+    markDirty(&dataBlocks[first], count * DATA_BLOCK_SIZE);
+    for (int i = 0; i < count; i++) {
+        bufferCache.frames[frameIndexes[i]].dirty = 0;
+    }
+    bufferCache.dirtyCount -= count;
+    bufferCache.writebacks += count;
+}
+
+// Fills frames caching expanded blocks of compressed units from key block
+// on, expanding each unit once. Frames of a unit that fails to expand are
+// marked corrupt. Called without the cache lock, on frames the caller marked
+// loading.
+void expandFrames(int64_t block, CacheFrame **frames, int count) {
+    char unit[COMPRESSION_UNIT_SIZE];
+    int expandedStart = -1;
+    int expanded = 0;
+    for (int i = 0; i < count; i++) {
+        int64_t key = block + i - COMPRESSED_KEY_BASE;
+        int start = key / COMPRESSION_UNIT_BLOCKS;
+        if (start != expandedStart) {
+            expanded = expandUnit(start, unit);
+            expandedStart = start;
+        }
+        memcpy(frames[i]->data, unit + key % COMPRESSION_UNIT_BLOCKS * DATA_BLOCK_SIZE, DATA_BLOCK_SIZE);
+        frames[i]->corrupt = expanded < 0;
+    }
+}
+
+// Fills the frames, which cache the blocks from block on, from the mapping
+// and checks them. Called without the cache lock, on frames the caller marked
+// loading; the block is passed in as invalidateBlocks may unlink them
+// meanwhile.
+void loadFrames(int64_t block, CacheFrame **frames, int count) {
+    if (count <= 0) {
+        return;
+    }
+    if (block >= COMPRESSED_KEY_BASE) {
+        expandFrames(block, frames, count);
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        memcpy(frames[i]->data, dataBlocks[block + i].data, DATA_BLOCK_SIZE);
+        frames[i]->corrupt = !blockIntact(block + i, frames[i]->data);
+    }
+    __atomic_fetch_add(&bufferCache.runReads, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&bufferCache.runReadBlocks, count, __ATOMIC_RELAXED);
+}
+
+void unlinkFrame(int frameIndex) {
+    int *link = &bufferCache.buckets[bufferCache.frames[frameIndex].block % CACHE_BUCKETS];
+    while (*link != frameIndex) {
+        link = &bufferCache.frames[*link].nextInBucket;
+    }
+    *link = bufferCache.frames[frameIndex].nextInBucket;
+}
+
+// Picks a frame to reuse with CLOCK, writing it back first if it is dirty.
+// Returns -1 if every frame is pinned.
+int evictFrame() {
+    for (int step = 0; step < 2 * CACHE_FRAMES; step++) {
+        int frameIndex = bufferCache.clockHand;
+        CacheFrame *frame = &bufferCache.frames[frameIndex];
+        bufferCache.clockHand = (bufferCache.clockHand + 1) % CACHE_FRAMES;
+
+        if (frame->pinCount > 0) {
+            continue;
+        }
+        if (frame->referenced) {
+            frame->referenced = 0;
+            continue;
+        }
+
+        if (frame->block != -1) {
+            if (frame->dirty) {
+                writeBackFrame(frame);
+            }
+            unlinkFrame(frameIndex);
+            bufferCache.evictions++;
+        }
+        return frameIndex;
+    }
+
+    return -1;
+}
+
+// Returns the frame caching block, or -1. Called with the cache lock held.
+int findFrame(int64_t block) {
+    int frameIndex = bufferCache.buckets[block % CACHE_BUCKETS];
+    while (frameIndex != -1 && bufferCache.frames[frameIndex].block != block) {
+        frameIndex = bufferCache.frames[frameIndex].nextInBucket;
+    }
+    return frameIndex;
+}
+
+// Gives block a frame of its own, evicting one if needed. Returns NULL if
+// every frame is pinned. Called with the cache lock held.
+CacheFrame *insertFrame(int64_t block) {
+    int frameIndex = evictFrame();
+    if (frameIndex == -1) {
+        return NULL;
+    }
+
+    CacheFrame *frame = &bufferCache.frames[frameIndex];
+    frame->block = block;
+    frame->corrupt = 0;
+    frame->nextInBucket = bufferCache.buckets[block % CACHE_BUCKETS];
+    bufferCache.buckets[block % CACHE_BUCKETS] = frameIndex;
+    return frame;
+}
+
+// Pins frames for blocks [start, start + count), at most MAX_IO_RUN of them.
+// Missing blocks are loaded a run of adjacent misses at a time unless
+// the caller is about to overwrite them in full. Returns how many leading
+// blocks were pinned; fewer than asked only if every frame is pinned.
+int getBlocks(int64_t start, int count, int loadContents, CacheFrame **frames) {
+    if (count > MAX_IO_RUN) {
+        count = MAX_IO_RUN;
+    }
+
+    pthread_mutex_lock(&bufferCache.lock);
+
+    char loading[MAX_IO_RUN];
+    int missed = 0;
+    int pinned = 0;
+    for (; pinned < count; pinned++) {
+        int64_t block = start + pinned;
+        int frameIndex = findFrame(block);
+        CacheFrame *frame;
+
+        loading[pinned] = 0;
+        if (frameIndex != -1) {
+            bufferCache.hits++;
+            frame = &bufferCache.frames[frameIndex];
+        } else {
+            bufferCache.misses++;
+            frame = insertFrame(block);
+            if (frame == NULL) {
+                break;
+            }
+            frame->loading = loadContents;
+            loading[pinned] = loadContents;
+            missed += loadContents;
+        }
+
+        frame->referenced = 1;
+        frame->pinCount++;
+        frames[pinned] = frame;
+    }
+
+    // Misses are loaded without the lock so other threads' hits and loads go
+    // on meanwhile; anyone else pinning these frames waits for them below
+    if (missed > 0) {
+        pthread_mutex_unlock(&bufferCache.lock);
+        for (int i = 0; i < pinned;) {
+            int end = i;
+            while (end < pinned && loading[end]) {
+                end++;
+            }
+            if (end > i) {
+                loadFrames(start + i, frames + i, end - i);
+            }
+            i = end + 1;
+        }
+        pthread_mutex_lock(&bufferCache.lock);
+        for (int i = 0; i < pinned; i++) {
+            if (loading[i]) {
+                frames[i]->loading = 0;
+            }
+        }
+        pthread_cond_broadcast(&bufferCache.frameLoaded);
+    }
+
+    // Blocks another thread is still loading are only usable once it lands
+    for (int i = 0; i < pinned; i++) {
+        while (frames[i]->loading) {
+            pthread_cond_wait(&bufferCache.frameLoaded, &bufferCache.lock);
+        }
+    }
+
+    pthread_mutex_unlock(&bufferCache.lock);
+    return pinned;
+}
+
+// Like getBlocks, but never loads or waits: frames it had to add are marked
+// loading and flagged in inserted for the caller to fill. Frames another
+// asynchronous read is loading come back still loading.
+int pinBlocksDeferred(int start, int count, CacheFrame **frames, char *inserted) {
+    if (count > MAX_IO_RUN) {
+        count = MAX_IO_RUN;
+    }
+
+    pthread_mutex_lock(&bufferCache.lock);
+
+    int pinned = 0;
+    for (; pinned < count; pinned++) {
+        int frameIndex = findFrame(start + pinned);
+        CacheFrame *frame;
+
+        if (frameIndex != -1) {
+            bufferCache.hits++;
+            frame = &bufferCache.frames[frameIndex];
+            inserted[pinned] = 0;
+        } else {
+            bufferCache.misses++;
+            frame = insertFrame(start + pinned);
+            if (frame == NULL) {
+                break;
+            }
+            frame->loading = 1;
+            inserted[pinned] = 1;
+        }
+
+        frame->referenced = 1;
+        frame->pinCount++;
+        frames[pinned] = frame;
+    }
+
+    pthread_mutex_unlock(&bufferCache.lock);
+    return pinned;
+}
+
+// Returns the pinned frame caching block, loading it from the image unless the
+// caller is about to overwrite all of it. Returns NULL if every frame is pinned.
+CacheFrame *getBlock(int block, int loadContents) {
+    CacheFrame *frame;
+    return (getBlocks(block, 1, loadContents, &frame) == 1) ? frame : NULL;
+}
+
+// NULL entries, which views use for holes, are skipped. Frames released dirty
+// were written whole or over intact contents, so they are no longer corrupt.
+void releaseBlocks(CacheFrame **frames, int count, int dirty) {
+    pthread_mutex_lock(&bufferCache.lock);
+
+    for (int i = 0; i < count; i++) {
+        CacheFrame *frame = frames[i];
+        if (frame == NULL) {
+            continue;
+        }
+        frame->pinCount--;
+        if (dirty && !frame->dirty) {
+            frame->dirty = 1;
+            bufferCache.dirtyCount++;
+        }
+        if (dirty) {
+            frame->corrupt = 0;
+        }
+    }
+    if (dirty && bufferCache.dirtyCount >= DIRTY_HIGH_WATERMARK) {
+        pthread_cond_signal(&bufferCache.flushNeeded);
+    }
+
+    pthread_mutex_unlock(&bufferCache.lock);
+}
+
+void releaseBlock(CacheFrame *frame, int dirty) {
+    releaseBlocks(&frame, 1, dirty);
+}
+
+// Drops cached copies of freed blocks without writing them back.
+void invalidateBlocks(int64_t start, int length) {
+    pthread_mutex_lock(&bufferCache.lock);
+
+    for (int64_t block = start; block < start + length; block++) {
+        int frameIndex = bufferCache.buckets[block % CACHE_BUCKETS];
+        while (frameIndex != -1 && bufferCache.frames[frameIndex].block != block) {
+            frameIndex = bufferCache.frames[frameIndex].nextInBucket;
+        }
+        if (frameIndex == -1) {
+            continue;
+        }
+
+        CacheFrame *frame = &bufferCache.frames[frameIndex];
+        unlinkFrame(frameIndex);
+        if (frame->dirty) {
+            bufferCache.dirtyCount--;
+        }
+        frame->block = -1;
+        frame->dirty = 0;
+        frame->referenced = 0;
+    }
+
+    pthread_mutex_unlock(&bufferCache.lock);
+}
+
+int compareFrameBlocks(const void *left, const void *right) {
+    int64_t leftBlock = bufferCache.frames[*(const int *) left].block;
+    int64_t rightBlock = bufferCache.frames[*(const int *) right].block;
+    return (leftBlock > rightBlock) - (leftBlock < rightBlock);
+}
+
+// Writes every unpinned dirty frame back, a run of adjacent blocks at a time,
+// then syncs the image.
+int flushBufferCache() {
+    pthread_mutex_lock(&bufferCache.lock);
+
+    int dirtyFrames[CACHE_FRAMES];
+    int dirtyCount = 0;
+    for (int i = 0; i < CACHE_FRAMES; i++) {
+        if (bufferCache.frames[i].dirty && bufferCache.frames[i].pinCount == 0) {
+            dirtyFrames[dirtyCount++] = i;
+        }
+    }
+    qsort(dirtyFrames, dirtyCount, sizeof(int), compareFrameBlocks);
+
+    for (int i = 0; i < dirtyCount;) {
+        int first = bufferCache.frames[dirtyFrames[i]].block;
+        int runLength = 1;
+        while (i + runLength < dirtyCount && runLength < MAX_IO_RUN &&
+               bufferCache.frames[dirtyFrames[i + runLength]].block == first + runLength) {
+            runLength++;
+        }
+        writeBackFrames(dirtyFrames + i, runLength);
+        i += runLength;
+    }
+
+    pthread_mutex_unlock(&bufferCache.lock);
+
+    return syncVolume();
+}
+
+void *flusherThread(void *arg) {
+    (void) arg;
+
+    int passes = 0;
+    pthread_mutex_lock(&bufferCache.lock);
+    while (!bufferCache.stopFlusher) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += FLUSH_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&bufferCache.flushNeeded, &bufferCache.lock, &deadline);
+
+        // Buffered blocks are left to pile up for a while so that each file's
+        // writes can be placed together
+        int placeDelayed = ++passes * FLUSH_INTERVAL_MS >= DELAYED_FLUSH_INTERVAL_MS ||
+                           __atomic_load_n(&delayedAllocation.reserved, __ATOMIC_RELAXED) >= DELAYED_HIGH_WATERMARK;
+        if (placeDelayed && !bufferCache.stopFlusher) {
+            passes = 0;
+            pthread_mutex_unlock(&bufferCache.lock);
+            flushAllDelayed();
+            pthread_mutex_lock(&bufferCache.lock);
+        }
+
+        if (bufferCache.dirtyCount > 0 && !bufferCache.stopFlusher) {
+            pthread_mutex_unlock(&bufferCache.lock);
+            flushBufferCache();
+            pthread_mutex_lock(&bufferCache.lock);
+        }
+
+        // Holds no lock a transaction could be waiting for, so it can wait
+        // for a moment with none open
+        if (!bufferCache.stopFlusher) {
+            pthread_mutex_unlock(&bufferCache.lock);
+            if (checkpointDue()) {
+                checkpointJournal();
+            }
+            pthread_mutex_lock(&bufferCache.lock);
+        }
+    }
+    pthread_mutex_unlock(&bufferCache.lock);
+
+    return NULL;
+}
+
+int startBufferCache() {
+    bufferCache.frames = malloc(CACHE_FRAMES * sizeof(CacheFrame));
+    if (bufferCache.frames == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < CACHE_FRAMES; i++) {
+        bufferCache.frames[i].block = -1;
+        bufferCache.frames[i].referenced = 0;
+        bufferCache.frames[i].dirty = 0;
+        bufferCache.frames[i].pinCount = 0;
+        bufferCache.frames[i].loading = 0;
+    }
+    for (int i = 0; i < CACHE_BUCKETS; i++) {
+        bufferCache.buckets[i] = -1;
+    }
+    bufferCache.clockHand = 0;
+    bufferCache.dirtyCount = 0;
+    bufferCache.hits = 0;
+    bufferCache.misses = 0;
+    bufferCache.evictions = 0;
+    bufferCache.writebacks = 0;
+    bufferCache.runReads = 0;
+    bufferCache.runReadBlocks = 0;
+    bufferCache.runWrites = 0;
+    bufferCache.runWriteBlocks = 0;
+    bufferCache.stopFlusher = 0;
+    pthread_mutex_init(&bufferCache.lock, NULL);
+    pthread_cond_init(&bufferCache.flushNeeded, NULL);
+    pthread_cond_init(&bufferCache.frameLoaded, NULL);
+
+    if (pthread_create(&bufferCache.flusher, NULL, flusherThread, NULL) != 0) {
+        free(bufferCache.frames);
+        return -1;
+    }
+    return 0;
+}
+
+void stopBufferCache() {
+    pthread_mutex_lock(&bufferCache.lock);
+    bufferCache.stopFlusher = 1;
+    pthread_cond_signal(&bufferCache.flushNeeded);
+    pthread_mutex_unlock(&bufferCache.lock);
+    pthread_join(bufferCache.flusher, NULL);
+
+    flushBufferCache();
+    free(bufferCache.frames);
+}
+
+// Loads the uncached blocks of [start, start + length) without pinning them,
+// a run of adjacent misses at a time.
+void prefetchBlocks(int start, int length, int inode, uint32_t generation) {
+    pthread_mutex_lock(&bufferCache.lock);
+
+    // Checked under the cache lock: deleting a file bumps its generation
+    // before invalidating its blocks, so a stale load cannot slip in between
+    FileMetadata *file = &inodeTable.inodes[inode];
+    if (!file->inUse || file->generation != generation) {
+        pthread_mutex_unlock(&bufferCache.lock);
+        return;
+    }
+
+    CacheFrame *frames[MAX_IO_RUN];
+    int missCount = 0;
+    for (int block = start; block < start + length; block++) {
+        CacheFrame *frame = (findFrame(block) == -1) ? insertFrame(block) : NULL;
+        if (frame != NULL) {
+            // Pinned until loaded so the rest of the run cannot evict it
+            frame->referenced = 0;
+            frame->pinCount++;
+            frame->loading = 1;
+            frames[missCount++] = frame;
+        }
+
+        // Load once the run of misses ends or fills the batch, without the
+        // lock; readers of these blocks wait for them to land
+        if (missCount > 0 && (frame == NULL || missCount == MAX_IO_RUN || block == start + length - 1)) {
+            int first = (frame == NULL) ? block - missCount : block - missCount + 1;
+            pthread_mutex_unlock(&bufferCache.lock);
+            loadFrames(first, frames, missCount);
+            pthread_mutex_lock(&bufferCache.lock);
+            for (int i = 0; i < missCount; i++) {
+                frames[i]->loading = 0;
+                frames[i]->pinCount--;
+            }
+            pthread_cond_broadcast(&bufferCache.frameLoaded);
+            readaheadQueue.loadedBlocks += missCount;
+            missCount = 0;
+            if (!file->inUse || file->generation != generation) {
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&bufferCache.lock);
+}
+
+void *readaheadThread(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&readaheadQueue.lock);
+    while (1) {
+        while (readaheadQueue.count == 0 && !readaheadQueue.stop) {
+            pthread_cond_wait(&readaheadQueue.available, &readaheadQueue.lock);
+        }
+        if (readaheadQueue.stop) {
+            break;
+        }
+
+        ReadaheadRequest request = readaheadQueue.requests[readaheadQueue.head];
+        readaheadQueue.head = (readaheadQueue.head + 1) % READAHEAD_QUEUE_SIZE;
+        readaheadQueue.count--;
+        pthread_mutex_unlock(&readaheadQueue.lock);
+
+        prefetchBlocks(request.start, request.length, request.inode, request.generation);
+
+        pthread_mutex_lock(&readaheadQueue.lock);
+    }
+    pthread_mutex_unlock(&readaheadQueue.lock);
+
+    return NULL;
+}
+
+// Length of the file's last block, which is partial unless it is a multiple
+// of DATA_BLOCK_SIZE.
+int lastBlockLength(FileMetadata *file) {
+    return (int) (file->size - (file->size - 1) / DATA_BLOCK_SIZE * DATA_BLOCK_SIZE);
+}
+
+// Extent i of the file; those past the inline ones live in extentBlock.
+Extent *fileExtent(FileMetadata *file, int i) {
+    if (i < MAX_EXTENTS) {
+        return &file->extents[i];
+    }
+    return (Extent *) metadataBlocks[file->extentBlock].data + (i - MAX_EXTENTS);
+}
+
+// Logical blocks the extent covers.
+int extentSpan(const Extent *extent) {
+    return (extent->flags & EXTENT_COMPRESSED) ? COMPRESSION_UNIT_BLOCKS : extent->length;
+}
+
+// Index of the last extent of the file starting at or before logicalBlock,
+// or -1 if there is none. Binary search, so seeking costs O(log extents).
+int findExtent(FileMetadata *file, int logicalBlock) {
+    int low = 0;
+    int high = file->extentCount - 1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        if (fileExtent(file, middle)->logical <= logicalBlock) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return high;
+}
+
+// Returns the data block holding logical block of the file and, in run, how
+// many blocks from there on are contiguous within its extent. In a
+// compressed unit it returns the cache key of the expanded block instead,
+// with run counting the rest of the unit. Returns -1 if the block is in a
+// hole, with run then counting the blocks up to the next extent.
+int64_t mapLogicalBlock(FileMetadata *file, int logicalBlock, int *run) {
+    int index = findExtent(file, logicalBlock);
+    Extent *found = (index >= 0) ? fileExtent(file, index) : NULL;
+    if (found == NULL || logicalBlock >= found->logical + extentSpan(found)) {
+        *run = (index + 1 < file->extentCount) ? fileExtent(file, index + 1)->logical - logicalBlock
+                                               : MAX_FILE_BLOCKS - logicalBlock;
+        return -1;
+    }
+
+    *run = found->logical + extentSpan(found) - logicalBlock;
+    if (found->flags & EXTENT_COMPRESSED) {
+        return COMPRESSED_KEY(found->start, logicalBlock - found->logical);
+    }
+    return found->start + (logicalBlock - found->logical);
+}
+
+// Maps the run of blocks from logicalBlock on that covers bytes, stopping at
+// the end of its extent or hole or after maxBlocks. Returns the number of
+// blocks, with the first in block as mapLogicalBlock gives it.
+int mapRun(FileMetadata *file, int logicalBlock, int64_t bytes, int maxBlocks, int64_t *block) {
+    int run;
+    *block = mapLogicalBlock(file, logicalBlock, &run);
+
+    int64_t wanted = (bytes + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+    if (wanted > run) {
+        wanted = run;
+    }
+    if (wanted > maxBlocks) {
+        wanted = maxBlocks;
+    }
+    return wanted;
+}
+
+// Queues logical blocks [first, end) of inode, one request per physical run.
+// Readahead is only a hint, so requests are dropped when the queue is full.
+void queueReadahead(int inode, int first, int end) {
+    FileMetadata *file = &inodeTable.inodes[inode];
+
+    pthread_mutex_lock(&readaheadQueue.lock);
+
+    int logicalBlock = first;
+    while (logicalBlock < end) {
+        int64_t start;
+        int length =
+            mapRun(file, logicalBlock, (int64_t) (end - logicalBlock) * DATA_BLOCK_SIZE, end - logicalBlock, &start);
+        if (start < 0 || start >= COMPRESSED_KEY_BASE) {
+            // Holes read as zeros without touching the disk, and compressed
+            // units are expanded whole when first read
+            logicalBlock += length;
+            continue;
+        }
+
+        if (readaheadQueue.count == READAHEAD_QUEUE_SIZE) {
+            readaheadQueue.droppedRequests++;
+        } else {
+            int tail = (readaheadQueue.head + readaheadQueue.count) % READAHEAD_QUEUE_SIZE;
+            ReadaheadRequest *request = &readaheadQueue.requests[tail];
+            request->inode = inode;
+            request->generation = file->generation;
+            request->start = start;
+            request->length = length;
+            readaheadQueue.count++;
+            readaheadQueue.queuedBlocks += length;
+        }
+        logicalBlock += length;
+    }
+
+    pthread_cond_signal(&readaheadQueue.available);
+    pthread_mutex_unlock(&readaheadQueue.lock);
+}
+
+// Called before each block a reader asks for. Reading from the start of a
+// file or straight on from the last block keeps the window open and doubles
+// it each time the reader catches up with half of it; any jump closes it.
+void updateReadahead(int inode, int logicalBlock) {
+    ReadaheadState *state = &inodeTable.states[inode].readahead;
+    FileMetadata *file = &inodeTable.inodes[inode];
+    int fileBlocks = (int) ((file->size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE);
+
+    // Several readers can share a file, so the state has its own lock
+    pthread_mutex_lock(&inodeTable.states[inode].readaheadLock);
+
+    if (logicalBlock == 0) {
+        state->window = READAHEAD_INITIAL_WINDOW;
+        state->prefetchedUntil = 1;
+    } else if (logicalBlock != state->nextBlock) {
+        state->window = 0;
+        state->prefetchedUntil = logicalBlock + 1;
+    } else if (state->window == 0) {
+        state->window = READAHEAD_INITIAL_WINDOW;
+    }
+    state->nextBlock = logicalBlock + 1;
+
+    if (state->window > 0 && state->prefetchedUntil - logicalBlock <= state->window / 2 &&
+        state->prefetchedUntil < fileBlocks) {
+        int end = logicalBlock + 1 + state->window;
+        if (end > fileBlocks) {
+            end = fileBlocks;
+        }
+        queueReadahead(inode, state->prefetchedUntil, end);
+        state->prefetchedUntil = end;
+
+        state->window *= 2;
+        if (state->window > READAHEAD_MAX_WINDOW) {
+            state->window = READAHEAD_MAX_WINDOW;
+        }
+    }
+
+    pthread_mutex_unlock(&inodeTable.states[inode].readaheadLock);
+}
+
+int startReadahead() {
+    readaheadQueue.head = 0;
+    readaheadQueue.count = 0;
+    readaheadQueue.queuedBlocks = 0;
+    readaheadQueue.loadedBlocks = 0;
+    readaheadQueue.droppedRequests = 0;
+    readaheadQueue.stop = 0;
+    pthread_mutex_init(&readaheadQueue.lock, NULL);
+    pthread_cond_init(&readaheadQueue.available, NULL);
+
+    return (pthread_create(&readaheadQueue.worker, NULL, readaheadThread, NULL) == 0) ? 0 : -1;
+}
+
+void stopReadahead() {
+    pthread_mutex_lock(&readaheadQueue.lock);
+    readaheadQueue.stop = 1;
+    pthread_cond_signal(&readaheadQueue.available);
+    pthread_mutex_unlock(&readaheadQueue.lock);
+    pthread_join(readaheadQueue.worker, NULL);
+}
+
+void printCacheStats() {
+    pthread_mutex_lock(&bufferCache.lock);
+    printf("Buffer cache: %ld hits, %ld misses, %ld evictions, %ld write-backs, %d dirty\n", bufferCache.hits,
+           bufferCache.misses, bufferCache.evictions, bufferCache.writebacks, bufferCache.dirtyCount);
+    printf("Batched I/O: %ld runs loaded (%ld blocks), %ld runs written back (%ld blocks)\n", bufferCache.runReads,
+           bufferCache.runReadBlocks, bufferCache.runWrites, bufferCache.runWriteBlocks);
+    pthread_mutex_unlock(&bufferCache.lock);
+
+    printf("Checksums (%s): %ld blocks verified, %ld failed; scrub: %ld passes, %ld blocks, %ld corrupt\n",
+           checksums.hardware ? "crc32 instruction" : "slicing-by-8",
+           __atomic_load_n(&checksums.verifiedBlocks, __ATOMIC_RELAXED),
+           __atomic_load_n(&checksums.failedBlocks, __ATOMIC_RELAXED),
+           __atomic_load_n(&scrubber.passes, __ATOMIC_RELAXED),
+           __atomic_load_n(&scrubber.scrubbedBlocks, __ATOMIC_RELAXED),
+           __atomic_load_n(&scrubber.corruptBlocks, __ATOMIC_RELAXED));
+
+    pthread_mutex_lock(&readaheadQueue.lock);
+    printf("Readahead: %ld blocks queued, %ld loaded, %ld requests dropped\n", readaheadQueue.queuedBlocks,
+           readaheadQueue.loadedBlocks, readaheadQueue.droppedRequests);
+    pthread_mutex_unlock(&readaheadQueue.lock);
+
+    pthread_mutex_lock(&ioEngine.lock);
+    printf("Async I/O (%s): %ld requests on the ring, %ld in the pool, %ld ring reads\n",
+           ioEngine.useRing ? "io_uring" : "thread pool", ioEngine.ringRequests, ioEngine.pooledRequests,
+           __atomic_load_n(&ioEngine.ringTransfers, __ATOMIC_RELAXED));
+    pthread_mutex_unlock(&ioEngine.lock);
+}
+
+// Groups covering the volume's current blocks. Groups added by growVolume
+// are set up before the count is raised, so readers never see a half-made one.
+int activeGroups() {
+    return __atomic_load_n(&freeSpace.groupCount, __ATOMIC_ACQUIRE);
+}
+
+// Derives the summary and free-block count of group g from freeMap.
+void loadGroup(int g) {
+    AllocationGroup *group = &freeSpace.groups[g];
+    int blockCount = superblock->blockCount;
+    group->start = g * BLOCKS_PER_GROUP;
+    group->end = (group->start + BLOCKS_PER_GROUP < blockCount) ? group->start + BLOCKS_PER_GROUP : blockCount;
+    group->summary = 0;
+    group->freeBlocks = 0;
+    group->nextFitCursor = group->start;
+    for (size_t i = 0; i < GROUP_WORDS && g * GROUP_WORDS + i < BITMAP_WORDS(blockCount); i++) {
+        uint64_t word = freeSpace.freeMap[g * GROUP_WORDS + i];
+        if (word != 0) {
+            group->summary |= 1ULL << i;
+            group->freeBlocks += __builtin_popcountll(word);
+        }
+    }
+}
+
+// Derives the group summaries and free-block counts from freeMap.
+void loadFreeSpace() {
+    freeSpace.groupCount = GROUPS_FOR(superblock->blockCount);
+    freeSpace.freeBlocks = 0;
+    for (int g = 0; g < freeSpace.groupCount; g++) {
+        loadGroup(g);
+        freeSpace.freeBlocks += freeSpace.groups[g].freeBlocks;
+    }
+}
+
+// Marks every block of the volume free in freeMap.
+void resetFreeMap() {
+    size_t words = BITMAP_WORDS(superblock->blockCount);
+    memset(freeSpace.freeMap, 0xff, words * sizeof(uint64_t));
+    if (superblock->blockCount % 64 != 0) {
+        freeSpace.freeMap[words - 1] = (1ULL << (superblock->blockCount % 64)) - 1;
+    }
+    markDirty(freeSpace.freeMap, words * sizeof(uint64_t));
+}
+
+int startAllocator() {
+    freeSpace.groupLimit = GROUPS_FOR(superblock->blockLimit);
+    freeSpace.groups = reserveArena(freeSpace.groupLimit, sizeof(AllocationGroup));
+    if (freeSpace.groups == NULL) {
+        return -1;
+    }
+    for (int g = 0; g < freeSpace.groupLimit; g++) {
+        pthread_mutex_init(&freeSpace.groups[g].lock, NULL);
+    }
+    for (int i = 0; i < MAX_MAGAZINES; i++) {
+        freeSpace.magazines[i].length = 0;
+        pthread_mutex_init(&freeSpace.magazines[i].lock, NULL);
+    }
+    freeSpace.magazineCount = 0;
+    freeSpace.parkedBlocks = 0;
+    return 0;
+}
+
+void stopAllocator() {
+    if (freeSpace.groups != NULL) {
+        for (int g = 0; g < freeSpace.groupLimit; g++) {
+            pthread_mutex_destroy(&freeSpace.groups[g].lock);
+        }
+        releaseArena(freeSpace.groups, freeSpace.groupLimit, sizeof(AllocationGroup));
+    }
+    freeSpace.groups = NULL;
+    freeSpace.groupCount = 0;
+}
+
+// Returns the first free block of group at or after block from, or -1 if
+// there is none.
+int nextFreeBlock(AllocationGroup *group, int from) {
+    if (from >= group->end) {
+        return -1;
+    }
+
+    int wordIndex = from / 64;
+    uint64_t word = freeSpace.freeMap[wordIndex] & (~0ULL << (from % 64));
+    if (word != 0) {
+        return wordIndex * 64 + __builtin_ctzll(word);
+    }
+
+    int groupWord = wordIndex + 1 - group->start / 64;
+    uint64_t candidates = (groupWord < 64) ? group->summary & (~0ULL << groupWord) : 0;
+    if (candidates == 0) {
+        return -1;
+    }
+    wordIndex = group->start / 64 + __builtin_ctzll(candidates);
+    return wordIndex * 64 + __builtin_ctzll(freeSpace.freeMap[wordIndex]);
+}
+
+// Returns how many free blocks follow start (inclusive) before the next used
+// one or the end of its group.
+int freeRunLength(AllocationGroup *group, int start) {
+    int wordIndex = start / 64;
+    int bit = start % 64;
+    int lastWord = (group->end - 1) / 64;
+    uint64_t rest = freeSpace.freeMap[wordIndex] >> bit;
+
+    if (rest != (~0ULL >> bit)) {
+        return __builtin_ctzll(~rest);
+    }
+
+    int length = 64 - bit;
+    wordIndex++;
+    while (wordIndex <= lastWord && freeSpace.freeMap[wordIndex] == ~0ULL) {
+        length += 64;
+        wordIndex++;
+    }
+    if (wordIndex <= lastWord) {
+        length += __builtin_ctzll(~freeSpace.freeMap[wordIndex]);
+    }
+
+    return length;
+}
+
+// Sets (free) or clears (used) the bits for blocks [start, start + length).
+// Only bits that change are counted, as rebuildFreeMap marks blocks shared by
+// several files once per owner. The caller holds the lock of every group the
+// run touches.
+void markBlocks(int start, int length, int free) {
+    int end = start + length;
+    while (start < end) {
+        int wordIndex = start / 64;
+        int bit = start % 64;
+        int count = (end - start < 64 - bit) ? end - start : 64 - bit;
+        uint64_t mask = (count == 64) ? ~0ULL : ((1ULL << count) - 1) << bit;
+        AllocationGroup *group = &freeSpace.groups[wordIndex / GROUP_WORDS];
+        uint64_t summaryBit = 1ULL << (wordIndex % GROUP_WORDS);
+        uint64_t word = freeSpace.freeMap[wordIndex];
+        int changed = __builtin_popcountll(free ? mask & ~word : mask & word);
+
+        if (free) {
+            freeSpace.freeMap[wordIndex] |= mask;
+            group->summary |= summaryBit;
+        } else {
+            freeSpace.freeMap[wordIndex] &= ~mask;
+            if (freeSpace.freeMap[wordIndex] == 0) {
+                group->summary &= ~summaryBit;
+            }
+        }
+        group->freeBlocks += free ? changed : -changed;
+        __atomic_fetch_add(&freeSpace.freeBlocks, free ? changed : -changed, __ATOMIC_RELAXED);
+        markDirty(&freeSpace.freeMap[wordIndex], sizeof(uint64_t));
+        start += count;
+    }
+}
+
+// Frees [start, start + length), taking each group's lock in turn.
+void releaseRun(int start, int length) {
+    int end = start + length;
+    while (start < end) {
+        AllocationGroup *group = &freeSpace.groups[start / BLOCKS_PER_GROUP];
+        int pieceEnd = (end < group->end) ? end : group->end;
+        pthread_mutex_lock(&group->lock);
+        markBlocks(start, pieceEnd - start, 1);
+        pthread_mutex_unlock(&group->lock);
+        start = pieceEnd;
+    }
+}
+
+// Best fit within group: the smallest run that holds everything, otherwise
+// the largest run.
+int findBestFit(AllocationGroup *group, int wanted, int *runStart) {
+    int bestStart = -1;
+    int bestLength = 0;
+
+    int start = nextFreeBlock(group, group->start);
+    while (start != -1) {
+        int length = freeRunLength(group, start);
+        if (length >= wanted) {
+            if (bestLength < wanted || length < bestLength) {
+                bestStart = start;
+                bestLength = length;
+            }
+            if (length == wanted) {
+                break;
+            }
+        } else if (length > bestLength && bestLength < wanted) {
+            bestStart = start;
+            bestLength = length;
+        }
+        start = nextFreeBlock(group, start + length);
+    }
+
+    *runStart = bestStart;
+    return bestLength;
+}
+
+// Next fit: the first run after where the group's previous allocation ended.
+int findNextFit(AllocationGroup *group, int *runStart) {
+    int start = nextFreeBlock(group, group->nextFitCursor);
+    if (start == -1) {
+        start = nextFreeBlock(group, group->start);
+    }
+
+    *runStart = start;
+    return (start == -1) ? 0 : freeRunLength(group, start);
+}
+
+// Threads claim magazines round robin; past MAX_MAGAZINES they share, which
+// the magazine lock makes safe. A thread's home group follows its magazine.
+Magazine *currentMagazine() {
+    if (threadMagazine == -1) {
+        threadMagazine = __atomic_fetch_add(&freeSpace.magazineCount, 1, __ATOMIC_RELAXED) % MAX_MAGAZINES;
+    }
+    return &freeSpace.magazines[threadMagazine];
+}
+
+int homeGroup() {
+    currentMagazine();
+    return threadMagazine % activeGroups();
+}
+
+// Returns the unused part of every magazine to its group.
+void drainMagazines() {
+    for (int i = 0; i < MAX_MAGAZINES; i++) {
+        Magazine *magazine = &freeSpace.magazines[i];
+        pthread_mutex_lock(&magazine->lock);
+        if (magazine->length > 0) {
+            releaseRun(magazine->start, magazine->length);
+            __atomic_fetch_sub(&freeSpace.parkedBlocks, magazine->length, __ATOMIC_RELAXED);
+            magazine->length = 0;
+        }
+        pthread_mutex_unlock(&magazine->lock);
+    }
+}
+
+// Carves blockCount blocks off the calling thread's magazine, refilling it
+// from the home group when it runs short. Returns 0 or -1 if no group has a
+// run of blockCount blocks to spare.
+int allocateFromMagazine(int blockCount, Extent *extent) {
+    Magazine *magazine = currentMagazine();
+    pthread_mutex_lock(&magazine->lock);
+
+    if (magazine->length < blockCount) {
+        if (magazine->length > 0) {
+            releaseRun(magazine->start, magazine->length);
+            __atomic_fetch_sub(&freeSpace.parkedBlocks, magazine->length, __ATOMIC_RELAXED);
+            magazine->length = 0;
+        }
+
+        int groupCount = activeGroups();
+        int home = homeGroup();
+        for (int i = 0; i < groupCount && magazine->length < blockCount; i++) {
+            AllocationGroup *group = &freeSpace.groups[(home + i) % groupCount];
+            pthread_mutex_lock(&group->lock);
+            int start;
+            int length = findBestFit(group, MAGAZINE_BLOCKS, &start);
+            if (length >= blockCount) {
+                if (length > MAGAZINE_BLOCKS) {
+                    length = MAGAZINE_BLOCKS;
+                }
+                // Parked first, so the free total never dips while it moves
+                __atomic_fetch_add(&freeSpace.parkedBlocks, length, __ATOMIC_RELAXED);
+                markBlocks(start, length, 0);
+                magazine->start = start;
+                magazine->length = length;
+            }
+            pthread_mutex_unlock(&group->lock);
+        }
+
+        if (magazine->length < blockCount) {
+            pthread_mutex_unlock(&magazine->lock);
+            return -1;
+        }
+    }
+
+    extent->start = magazine->start;
+    extent->length = blockCount;
+    magazine->start += blockCount;
+    magazine->length -= blockCount;
+    __atomic_fetch_sub(&freeSpace.parkedBlocks, blockCount, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&magazine->lock);
+    return 0;
+}
+
+// Takes runs from the groups, home group first, until blockCount blocks are
+// covered. A run that holds everything is preferred over splitting the file.
+// Returns the number of extents, -1 if there is not enough free space and -2
+// if it is too fragmented to fit in maxExtents runs.
+int allocateFromGroups(int blockCount, Extent *extents, int maxExtents) {
+    int groupCount = activeGroups();
+    int home = homeGroup();
+
+    if (allocationPolicy == ALLOCATION_BEST_FIT) {
+        for (int i = 0; i < groupCount; i++) {
+            AllocationGroup *group = &freeSpace.groups[(home + i) % groupCount];
+            pthread_mutex_lock(&group->lock);
+            int start;
+            if (group->freeBlocks >= blockCount && findBestFit(group, blockCount, &start) >= blockCount) {
+                markBlocks(start, blockCount, 0);
+                pthread_mutex_unlock(&group->lock);
+                extents[0].start = start;
+                extents[0].length = blockCount;
+                return 1;
+            }
+            pthread_mutex_unlock(&group->lock);
+        }
+    }
+
+    int extentCount = 0;
+    int remaining = blockCount;
+    for (int i = 0; i < groupCount && remaining > 0 && extentCount < maxExtents; i++) {
+        AllocationGroup *group = &freeSpace.groups[(home + i) % groupCount];
+        pthread_mutex_lock(&group->lock);
+        while (remaining > 0 && extentCount < maxExtents && group->freeBlocks > 0) {
+            int start;
+            int length = (allocationPolicy == ALLOCATION_NEXT_FIT) ? findNextFit(group, &start)
+                                                                   : findBestFit(group, remaining, &start);
+            if (length > remaining) {
+                length = remaining;
+            }
+
+            markBlocks(start, length, 0);
+            extents[extentCount].start = start;
+            extents[extentCount].length = length;
+            extentCount++;
+
+            remaining -= length;
+            group->nextFitCursor = start + length;
+        }
+        pthread_mutex_unlock(&group->lock);
+    }
+
+    if (remaining == 0) {
+        return extentCount;
+    }
+
+    for (int i = 0; i < extentCount; i++) {
+        releaseRun(extents[i].start, extents[i].length);
+    }
+    return (extentCount == maxExtents) ? -2 : -1;
+}
+
+// Free blocks, counting those parked in magazines, without taking a lock.
+// Exact only while nothing is being allocated or freed.
+int availableBlocks() {
+    return __atomic_load_n(&freeSpace.freeBlocks, __ATOMIC_RELAXED) +
+           __atomic_load_n(&freeSpace.parkedBlocks, __ATOMIC_RELAXED);
+}
+
+// Allocates blockCount blocks as at most maxExtents runs. Returns the number of
+// extents used, -1 if there is not enough free space and -2 if the free space
+// is too fragmented to fit in maxExtents runs.
+int allocateExtents(int blockCount, Extent *extents, int maxExtents) {
+    if (blockCount > availableBlocks()) {
+        return -1;
+    }
+
+    if (blockCount <= MAGAZINE_BLOCKS && allocationPolicy == ALLOCATION_BEST_FIT &&
+        allocateFromMagazine(blockCount, &extents[0]) == 0) {
+        return 1;
+    }
+
+    // Space parked in other threads' magazines still counts
+    if (blockCount > __atomic_load_n(&freeSpace.freeBlocks, __ATOMIC_RELAXED)) {
+        drainMagazines();
+    }
+    int extentCount = allocateFromGroups(blockCount, extents, maxExtents);
+    if (extentCount < 0 && __atomic_load_n(&freeSpace.parkedBlocks, __ATOMIC_RELAXED) > 0) {
+        drainMagazines();
+        extentCount = allocateFromGroups(blockCount, extents, maxExtents);
+    }
+    return extentCount;
+}
+
+// Whether any block is shared or indexed. Until one is, blocks are freed and
+// written without the sharing lock: a block of a file only becomes shared
+// through the index or under the file's own lock.
+int blocksShared() {
+    return __atomic_load_n(&blockRefs.sharedBlocks, __ATOMIC_ACQUIRE) > 0 ||
+           __atomic_load_n(&dedupIndex.indexedBlocks, __ATOMIC_ACQUIRE) > 0;
+}
+
+// Called with blockRefs.lock held.
+void unindexBlock(int block) {
+    uint64_t bit = 1ULL << (block % 64);
+    if (dedupIndex.indexed[block / 64] & bit) {
+        dedupIndex.indexed[block / 64] &= ~bit;
+        __atomic_fetch_sub(&dedupIndex.indexedBlocks, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Adds an owner to each of count blocks from start on. Called with
+// blockRefs.lock held, inside a transaction.
+void addReferences(int start, int count) {
+    for (int block = start; block < start + count; block++) {
+        if (blockRefs.refs[block]++ == 0) {
+            __atomic_fetch_add(&blockRefs.sharedBlocks, 1, __ATOMIC_RELEASE);
+        }
+    }
+    __atomic_fetch_add(&blockRefs.extraReferences, count, __ATOMIC_RELAXED);
+    markDirty(&blockRefs.refs[start], count * sizeof(uint32_t));
+}
+
+// Drops an owner of block. Returns 1 if others remain, or 0 if the caller was
+// the last, in which case the block leaves the index and is the caller's to
+// free. Called with blockRefs.lock held, inside a transaction.
+int dropReference(int block) {
+    if (blockRefs.refs[block] == 0) {
+        unindexBlock(block);
+        return 0;
+    }
+    if (--blockRefs.refs[block] == 0) {
+        __atomic_fetch_sub(&blockRefs.sharedBlocks, 1, __ATOMIC_RELEASE);
+    }
+    __atomic_fetch_sub(&blockRefs.extraReferences, 1, __ATOMIC_RELAXED);
+    markDirty(&blockRefs.refs[block], sizeof(uint32_t));
+    return 1;
+}
+
+// Returns how many blocks from start on, up to count, only the caller's file
+// owns, taking them out of the index so they can be written in place.
+int ownBlocks(int start, int count) {
+    if (!blocksShared()) {
+        return count;
+    }
+
+    pthread_mutex_lock(&blockRefs.lock);
+    int owned = 0;
+    while (owned < count && blockRefs.refs[start + owned] == 0) {
+        unindexBlock(start + owned);
+        owned++;
+    }
+    pthread_mutex_unlock(&blockRefs.lock);
+    return owned;
+}
+
+// Drops cached copies of the blocks of extent, then frees them.
+void freeExtent(const Extent *extent) {
+    invalidateBlocks(extent->start, extent->length);
+    if (extent->flags & EXTENT_COMPRESSED) {
+        invalidateBlocks(COMPRESSED_KEY(extent->start, 0), COMPRESSION_UNIT_BLOCKS);
+    }
+    releaseRun(extent->start, extent->length);
+}
+
+// Gives back the blocks of the extents. Blocks other files also own only lose
+// a reference and keep their cached copies.
+void releaseExtents(Extent *extents, int extentCount) {
+    if (!blocksShared()) {
+        for (int i = 0; i < extentCount; i++) {
+            freeExtent(&extents[i]);
+        }
+        return;
+    }
+
+    for (int i = 0; i < extentCount; i++) {
+        int end = extents[i].start + extents[i].length;
+        int runStart = -1;
+        pthread_mutex_lock(&blockRefs.lock);
+        for (int block = extents[i].start; block <= end; block++) {
+            if (block < end && !dropReference(block)) {
+                runStart = (runStart == -1) ? block : runStart;
+                continue;
+            }
+            if (runStart != -1) {
+                // Expanded copies of a unit are keyed by its first block
+                Extent run = {.start = runStart,
+                              .length = block - runStart,
+                              .flags = (runStart == extents[i].start) ? extents[i].flags : 0};
+                freeExtent(&run);
+                runStart = -1;
+            }
+        }
+        pthread_mutex_unlock(&blockRefs.lock);
+    }
+}
+
+// Whether block holds the same bytes as data, looking at its cached copy if it
+// has one, as that may not have been written back yet. Called with
+// blockRefs.lock held.
+int sameContents(int block, const char *data) {
+    pthread_mutex_lock(&bufferCache.lock);
+    int frameIndex = findFrame(block);
+    int same;
+    if (frameIndex == -1) {
+        same = memcmp(dataBlocks[block].data, data, DATA_BLOCK_SIZE) == 0;
+    } else {
+        CacheFrame *frame = &bufferCache.frames[frameIndex];
+        same = !frame->loading && !frame->corrupt && memcmp(frame->data, data, DATA_BLOCK_SIZE) == 0;
+    }
+    pthread_mutex_unlock(&bufferCache.lock);
+    return same;
+}
+
+// Returns an indexed block holding data, whose fingerprint is given, or -1.
+// Called with blockRefs.lock held.
+int findDuplicate(const char *data, uint32_t fingerprint) {
+    for (int i = 0; i < DEDUP_PROBE_SLOTS; i++) {
+        DedupEntry *entry = &dedupIndex.entries[(fingerprint + i) % DEDUP_INDEX_SLOTS];
+        if (entry->block >= 0 && entry->fingerprint == fingerprint &&
+            (dedupIndex.indexed[entry->block / 64] & (1ULL << (entry->block % 64))) &&
+            sameContents(entry->block, data)) {
+            return entry->block;
+        }
+    }
+    return -1;
+}
+
+// Adds block, whose contents have the given fingerprint, to the index, in
+// place of the block in its home slot when all the slots it may take are in
+// use. Called with blockRefs.lock held.
+void indexBlock(int block, uint32_t fingerprint) {
+    DedupEntry *slot = &dedupIndex.entries[fingerprint % DEDUP_INDEX_SLOTS];
+    int found = 0;
+    for (int i = 0; i < DEDUP_PROBE_SLOTS && !found; i++) {
+        DedupEntry *entry = &dedupIndex.entries[(fingerprint + i) % DEDUP_INDEX_SLOTS];
+        if (entry->block < 0 || !(dedupIndex.indexed[entry->block / 64] & (1ULL << (entry->block % 64)))) {
+            slot = entry;
+            found = 1;
+        }
+    }
+    if (!found) {
+        unindexBlock(slot->block);
+        dedupIndex.replaced++;
+    }
+
+    slot->fingerprint = fingerprint;
+    slot->block = block;
+    if (!(dedupIndex.indexed[block / 64] & (1ULL << (block % 64)))) {
+        dedupIndex.indexed[block / 64] |= 1ULL << (block % 64);
+        __atomic_fetch_add(&dedupIndex.indexedBlocks, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Free blocks, counting those reserved in magazines.
+int countFreeBlocks() {
+    int freeBlocks = 0;
+    int groupCount = activeGroups();
+    for (int g = 0; g < groupCount; g++) {
+        pthread_mutex_lock(&freeSpace.groups[g].lock);
+        freeBlocks += freeSpace.groups[g].freeBlocks;
+        pthread_mutex_unlock(&freeSpace.groups[g].lock);
+    }
+    for (int i = 0; i < MAX_MAGAZINES; i++) {
+        pthread_mutex_lock(&freeSpace.magazines[i].lock);
+        freeBlocks += freeSpace.magazines[i].length;
+        pthread_mutex_unlock(&freeSpace.magazines[i].lock);
+    }
+    return freeBlocks;
+}
+
+// Logical blocks in use per physical one: how much sharing saves.
+double dedupRatio() {
+    long usedBlocks = superblock->blockCount - countFreeBlocks();
+    long extraReferences = __atomic_load_n(&blockRefs.extraReferences, __ATOMIC_RELAXED);
+    return (usedBlocks > 0) ? (double) (usedBlocks + extraReferences) / usedBlocks : 1.0;
+}
+
+// Sets up the dedup index, empty, and the totals of the reference counts.
+int startDedup() {
+    dedupIndex.indexed = reserveArena(BITMAP_WORDS(superblock->blockLimit), sizeof(uint64_t));
+    if (dedupIndex.indexed == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < DEDUP_INDEX_SLOTS; i++) {
+        dedupIndex.entries[i].block = -1;
+    }
+    dedupIndex.indexedBlocks = 0;
+
+    blockRefs.sharedBlocks = 0;
+    blockRefs.extraReferences = 0;
+    for (uint32_t block = 0; block < superblock->blockCount; block++) {
+        blockRefs.sharedBlocks += blockRefs.refs[block] > 0;
+        blockRefs.extraReferences += blockRefs.refs[block];
+    }
+    return 0;
+}
+
+// Marks slots of the tail block holding block as used, adding the block to
+// the store if it is not there yet. Returns the entry, or NULL if the store
+// could not grow. The caller holds tailStore.lock.
+TailBlock *claimTailSlots(int block, uint32_t slots) {
+    for (int i = tailStore.count - 1; i >= 0; i--) {
+        if (tailStore.blocks[i].block == block) {
+            tailStore.blocks[i].used |= slots;
+            return &tailStore.blocks[i];
+        }
+    }
+
+    if (tailStore.count == tailStore.capacity) {
+        int capacity = (tailStore.capacity > 0) ? tailStore.capacity * 2 : 16;
+        TailBlock *grown = realloc(tailStore.blocks, capacity * sizeof(TailBlock));
+        if (grown == NULL) {
+            return NULL;
+        }
+        tailStore.blocks = grown;
+        tailStore.capacity = capacity;
+    }
+    tailStore.blocks[tailStore.count] = (TailBlock) {.block = block, .used = slots};
+    return &tailStore.blocks[tailStore.count++];
+}
+
+uint32_t tailSlots(int offset, int length) {
+    int count = (length + TAIL_SLOT_SIZE - 1) / TAIL_SLOT_SIZE;
+    return ((1U << count) - 1) << (offset / TAIL_SLOT_SIZE);
+}
+
+// Finds room for a tail of length bytes, preferring blocks that already hold
+// tails, and returns where it goes in block and offset. Returns 0, or -7 if
+// a new tail block was needed and none could be allocated.
+int allocateTail(int length, int *block, int *offset) {
+    int count = (length + TAIL_SLOT_SIZE - 1) / TAIL_SLOT_SIZE;
+    pthread_mutex_lock(&tailStore.lock);
+    for (int i = tailStore.count - 1; i >= 0; i--) {
+        TailBlock *tail = &tailStore.blocks[i];
+        for (int slot = 0; slot + count <= TAIL_SLOTS; slot++) {
+            uint32_t slots = tailSlots(slot * TAIL_SLOT_SIZE, length);
+            if ((tail->used & slots) == 0) {
+                tail->used |= slots;
+                *block = tail->block;
+                *offset = slot * TAIL_SLOT_SIZE;
+                pthread_mutex_unlock(&tailStore.lock);
+                return 0;
+            }
+        }
+    }
+
+    Extent extent;
+    if (allocateExtents(1, &extent, 1) != 1) {
+        pthread_mutex_unlock(&tailStore.lock);
+        return -7;
+    }
+    if (claimTailSlots(extent.start, tailSlots(0, length)) == NULL) {
+        releaseExtents(&extent, 1);
+        pthread_mutex_unlock(&tailStore.lock);
+        return -7;
+    }
+    pthread_mutex_unlock(&tailStore.lock);
+    *block = extent.start;
+    *offset = 0;
+    return 0;
+}
+
+// Gives back the slots of a tail, and its block once no tail is left there.
+void releaseTail(int block, int offset, int length) {
+    pthread_mutex_lock(&tailStore.lock);
+    for (int i = 0; i < tailStore.count; i++) {
+        TailBlock *tail = &tailStore.blocks[i];
+        if (tail->block != block) {
+            continue;
+        }
+        tail->used &= ~tailSlots(offset, length);
+        if (tail->used == 0) {
+            Extent extent = {.start = block, .length = 1};
+            releaseExtents(&extent, 1);
+            *tail = tailStore.blocks[--tailStore.count];
+        }
+        break;
+    }
+    pthread_mutex_unlock(&tailStore.lock);
+}
+
+// FNV-1a, continued from hash so prefixes can be hashed incrementally.
+uint32_t hashBytes(uint32_t hash, const char *bytes, int length) {
+    for (int i = 0; i < length; i++) {
+        hash ^= (unsigned char) bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Splits path into components, ignoring repeated and trailing slashes. Paths
+// are always taken from the root.
+int parsePath(const char *path, ParsedPath *parsed) {
+    int length = 0;
+    parsed->depth = 0;
+    uint32_t hash = 2166136261u;
+
+    while (*path != '\0') {
+        while (*path == '/') {
+            path++;
+        }
+        if (*path == '\0') {
+            break;
+        }
+
+        const char *component = path;
+        while (*path != '\0' && *path != '/') {
+            path++;
+        }
+        int componentLength = path - component;
+
+        if (componentLength >= MAX_FILENAME_LENGTH || parsed->depth == MAX_PATH_DEPTH ||
+            length + 1 + componentLength >= MAX_PATH_LENGTH) {
+            return -1;
+        }
+
+        parsed->text[length++] = '/';
+        parsed->componentStarts[parsed->depth] = length;
+        memcpy(parsed->text + length, component, componentLength);
+        length += componentLength;
+        parsed->componentEnds[parsed->depth] = length;
+
+        hash = hashBytes(hash, parsed->text + length - componentLength - 1, componentLength + 1);
+        parsed->prefixHashes[parsed->depth] = hash;
+        parsed->depth++;
+    }
+
+    parsed->text[length] = '\0';
+    return 0;
+}
+
+void copyComponent(ParsedPath *parsed, int component, char *name) {
+    int length = parsed->componentEnds[component] - parsed->componentStarts[component];
+    memcpy(name, parsed->text + parsed->componentStarts[component], length);
+    name[length] = '\0';
+}
+
+// The new table is filled in before it is published, and the slots before
+// the capacity, so a lock-free reader never probes past the end of a table.
+int initializeDentryCache(int capacity) {
+    DentrySlot *slots = calloc(capacity, sizeof(DentrySlot));
+    if (slots == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < capacity; i++) {
+        slots[i].inode = -1;
+    }
+    __atomic_store_n(&dentryCache.slots, slots, __ATOMIC_RELEASE);
+    __atomic_store_n(&dentryCache.capacity, capacity, __ATOMIC_RELEASE);
+    dentryCache.used = 0;
+    return 0;
+}
+
+// Returns the cached inode for the first depth components of parsed, or -1.
+// Safe without fileSystemLock; a lock-free caller validates the result with
+// the namespace sequence.
+int lookupDentry(ParsedPath *parsed, int depth) {
+    uint32_t hash = parsed->prefixHashes[depth - 1];
+    int prefixLength = parsed->componentEnds[depth - 1];
+    int capacity = __atomic_load_n(&dentryCache.capacity, __ATOMIC_ACQUIRE);
+    DentrySlot *slots = __atomic_load_n(&dentryCache.slots, __ATOMIC_ACQUIRE);
+    int mask = capacity - 1;
+
+    int slot = hash & mask;
+    for (int probes = 0; probes < capacity && slots[slot].inode != -1; probes++) {
+        DentrySlot *entry = &slots[slot];
+        char *path = entry->path;
+        int inode = entry->inode;
+        if (entry->hash == hash && path != NULL && inode >= 0 && strncmp(path, parsed->text, prefixLength) == 0 &&
+            path[prefixLength] == '\0') {
+            FileMetadata *file = &inodeTable.inodes[inode];
+            if (file->inUse && file->generation == entry->generation) {
+                __atomic_fetch_add(&dentryCache.hits, 1, __ATOMIC_RELAXED);
+                return inode;
+            }
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    __atomic_fetch_add(&dentryCache.misses, 1, __ATOMIC_RELAXED);
+    return -1;
+}
+
+void insertDentrySlot(uint32_t hash, char *path, int inode, uint32_t generation) {
+    int mask = dentryCache.capacity - 1;
+    int slot = hash & mask;
+    while (dentryCache.slots[slot].inode != -1) {
+        if (dentryCache.slots[slot].hash == hash && strcmp(dentryCache.slots[slot].path, path) == 0) {
+            // Replace a stale entry for the same path
+            retireMemory(dentryCache.slots[slot].path);
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if (dentryCache.slots[slot].inode == -1) {
+        dentryCache.used++;
+    }
+    dentryCache.slots[slot].hash = hash;
+    dentryCache.slots[slot].path = path;
+    dentryCache.slots[slot].inode = inode;
+    dentryCache.slots[slot].generation = generation;
+}
+
+// Grows the cache up to MAX_DENTRY_CACHE_CAPACITY, then starts over empty.
+void makeRoomInDentryCache() {
+    if ((dentryCache.used + 1) * 4 <= dentryCache.capacity * 3) {
+        return;
+    }
+
+    DentrySlot *oldSlots = dentryCache.slots;
+    int oldCapacity = dentryCache.capacity;
+    int keepEntries = oldCapacity < MAX_DENTRY_CACHE_CAPACITY;
+    int newCapacity = keepEntries ? oldCapacity * 2 : oldCapacity;
+
+    if (initializeDentryCache(newCapacity) != 0) {
+        dentryCache.slots = oldSlots;
+        dentryCache.capacity = oldCapacity;
+        keepEntries = 0;
+        for (int i = 0; i < oldCapacity; i++) {
+            oldSlots[i].inode = -1;
+            retireMemory(oldSlots[i].path);
+            oldSlots[i].path = NULL;
+        }
+        dentryCache.used = 0;
+        return;
+    }
+
+    for (int i = 0; i < oldCapacity; i++) {
+        if (oldSlots[i].inode == -1) {
+            continue;
+        }
+        if (keepEntries) {
+            insertDentrySlot(oldSlots[i].hash, oldSlots[i].path, oldSlots[i].inode, oldSlots[i].generation);
+        } else {
+            retireMemory(oldSlots[i].path);
+        }
+    }
+    retireMemory(oldSlots);
+}
+
+void insertDentry(ParsedPath *parsed, int depth, int inode) {
+    int prefixLength = parsed->componentEnds[depth - 1];
+    char *path = malloc(prefixLength + 1);
+    if (path == NULL) {
+        return;
+    }
+    memcpy(path, parsed->text, prefixLength);
+    path[prefixLength] = '\0';
+
+    beginNamespaceWrite();
+    makeRoomInDentryCache();
+    insertDentrySlot(parsed->prefixHashes[depth - 1], path, inode, inodeTable.inodes[inode].generation);
+    endNamespaceWrite();
+}
+
+int compareEntry(const char *name, int inode) {
+    return strcmp(name, inodeTable.inodes[inode].name);
+}
+
+// Index of the first key in node whose name is >= name.
+int lowerBound(BTreeNode *node, const char *name) {
+    int low = 0;
+    int high = node->keyCount;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (compareEntry(name, node->keys[middle]) > 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Also runs without fileSystemLock. A node never changes level, so even a
+// torn read of a node being rebalanced keeps descending towards a leaf.
+int searchDirectory(int directory, const char *name) {
+    BTreeNode *node = inodeTable.entries[directory];
+    while (node != NULL) {
+        int i = lowerBound(node, name);
+        if (i < node->keyCount && compareEntry(name, node->keys[i]) == 0) {
+            return node->keys[i];
+        }
+        node = node->leaf ? NULL : node->children[i];
+    }
+    return -1;
+}
+
+BTreeNode *createNode(int leaf) {
+    BTreeNode *node = calloc(1, sizeof(BTreeNode));
+    if (node != NULL) {
+        node->leaf = leaf;
+    }
+    return node;
+}
+
+// Splits the full child i of parent around its median key.
+int splitChild(BTreeNode *parent, int i) {
+    BTreeNode *full = parent->children[i];
+    BTreeNode *right = createNode(full->leaf);
+    if (right == NULL) {
+        return -1;
+    }
+
+    right->keyCount = BTREE_MIN_DEGREE - 1;
+    memcpy(right->keys, full->keys + BTREE_MIN_DEGREE, right->keyCount * sizeof(int));
+    if (!full->leaf) {
+        memcpy(right->children, full->children + BTREE_MIN_DEGREE, BTREE_MIN_DEGREE * sizeof(BTreeNode *));
+    }
+    full->keyCount = BTREE_MIN_DEGREE - 1;
+
+    memmove(parent->children + i + 2, parent->children + i + 1, (parent->keyCount - i) * sizeof(BTreeNode *));
+    memmove(parent->keys + i + 1, parent->keys + i, (parent->keyCount - i) * sizeof(int));
+    parent->children[i + 1] = right;
+    parent->keys[i] = full->keys[BTREE_MIN_DEGREE - 1];
+    parent->keyCount++;
+    return 0;
+}
+
+int insertEntry(int directory, int inode) {
+    const char *name = inodeTable.inodes[inode].name;
+    BTreeNode **root = &inodeTable.entries[directory];
+
+    if (*root == NULL) {
+        *root = createNode(1);
+        if (*root == NULL) {
+            return -1;
+        }
+    }
+
+    if ((*root)->keyCount == BTREE_MAX_KEYS) {
+        BTreeNode *newRoot = createNode(0);
+        if (newRoot == NULL) {
+            return -1;
+        }
+        newRoot->children[0] = *root;
+        if (splitChild(newRoot, 0) != 0) {
+            free(newRoot);
+            return -1;
+        }
+        *root = newRoot;
+    }
+
+    // Split full nodes on the way down so the leaf always has room
+    BTreeNode *node = *root;
+    while (!node->leaf) {
+        int i = lowerBound(node, name);
+        if (node->children[i]->keyCount == BTREE_MAX_KEYS) {
+            if (splitChild(node, i) != 0) {
+                return -1;
+            }
+            if (compareEntry(name, node->keys[i]) > 0) {
+                i++;
+            }
+        }
+        node = node->children[i];
+    }
+
+    int i = lowerBound(node, name);
+    memmove(node->keys + i + 1, node->keys + i, (node->keyCount - i) * sizeof(int));
+    node->keys[i] = inode;
+    node->keyCount++;
+    inodeTable.inodes[directory].entryCount++;
+    markDirty(&inodeTable.inodes[directory], sizeof(FileMetadata));
+    return 0;
+}
+
+// Folds child i + 1 and the key between them into child i.
+void mergeChildren(BTreeNode *node, int i) {
+    BTreeNode *left = node->children[i];
+    BTreeNode *right = node->children[i + 1];
+
+    left->keys[left->keyCount] = node->keys[i];
+    memcpy(left->keys + left->keyCount + 1, right->keys, right->keyCount * sizeof(int));
+    if (!left->leaf) {
+        memcpy(left->children + left->keyCount + 1, right->children, (right->keyCount + 1) * sizeof(BTreeNode *));
+    }
+    left->keyCount += right->keyCount + 1;
+
+    memmove(node->keys + i, node->keys + i + 1, (node->keyCount - i - 1) * sizeof(int));
+    memmove(node->children + i + 1, node->children + i + 2, (node->keyCount - i - 1) * sizeof(BTreeNode *));
+    node->keyCount--;
+    retireMemory(right);
+}
+
+// Makes sure child i of node has at least BTREE_MIN_DEGREE keys before we
+// descend into it. Returns the index of the child to descend into.
+int fillChild(BTreeNode *node, int i) {
+    BTreeNode *child = node->children[i];
+    if (child->keyCount >= BTREE_MIN_DEGREE) {
+        return i;
+    }
+
+    if (i > 0 && node->children[i - 1]->keyCount >= BTREE_MIN_DEGREE) {
+        BTreeNode *left = node->children[i - 1];
+        memmove(child->keys + 1, child->keys, child->keyCount * sizeof(int));
+        if (!child->leaf) {
+            memmove(child->children + 1, child->children, (child->keyCount + 1) * sizeof(BTreeNode *));
+            child->children[0] = left->children[left->keyCount];
+        }
+        child->keys[0] = node->keys[i - 1];
+        node->keys[i - 1] = left->keys[left->keyCount - 1];
+        child->keyCount++;
+        left->keyCount--;
+        return i;
+    }
+
+    if (i < node->keyCount && node->children[i + 1]->keyCount >= BTREE_MIN_DEGREE) {
+        BTreeNode *right = node->children[i + 1];
+        child->keys[child->keyCount] = node->keys[i];
+        if (!child->leaf) {
+            child->children[child->keyCount + 1] = right->children[0];
+            memmove(right->children, right->children + 1, right->keyCount * sizeof(BTreeNode *));
+        }
+        node->keys[i] = right->keys[0];
+        memmove(right->keys, right->keys + 1, (right->keyCount - 1) * sizeof(int));
+        child->keyCount++;
+        right->keyCount--;
+        return i;
+    }
+
+    if (i < node->keyCount) {
+        mergeChildren(node, i);
+        return i;
+    }
+    mergeChildren(node, i - 1);
+    return i - 1;
+}
+
+void removeFromNode(BTreeNode *node, const char *name) {
+    while (1) {
+        int i = lowerBound(node, name);
+        int found = i < node->keyCount && compareEntry(name, node->keys[i]) == 0;
+
+        if (node->leaf) {
+            if (found) {
+                memmove(node->keys + i, node->keys + i + 1, (node->keyCount - i - 1) * sizeof(int));
+                node->keyCount--;
+            }
+            return;
+        }
+
+        if (found) {
+            BTreeNode *left = node->children[i];
+            BTreeNode *right = node->children[i + 1];
+            if (left->keyCount >= BTREE_MIN_DEGREE) {
+                // Replace with the predecessor, then delete that from the left subtree
+                BTreeNode *last = left;
+                while (!last->leaf) {
+                    last = last->children[last->keyCount];
+                }
+                node->keys[i] = last->keys[last->keyCount - 1];
+                name = inodeTable.inodes[node->keys[i]].name;
+                node = left;
+            } else if (right->keyCount >= BTREE_MIN_DEGREE) {
+                BTreeNode *first = right;
+                while (!first->leaf) {
+                    first = first->children[0];
+                }
+                node->keys[i] = first->keys[0];
+                name = inodeTable.inodes[node->keys[i]].name;
+                node = right;
+            } else {
+                mergeChildren(node, i);
+                node = left;
+            }
+            continue;
+        }
+
+        node = node->children[fillChild(node, i)];
+    }
+}
+
+void removeEntry(int directory, const char *name) {
+    BTreeNode *root = inodeTable.entries[directory];
+    removeFromNode(root, name);
+    inodeTable.inodes[directory].entryCount--;
+    markDirty(&inodeTable.inodes[directory], sizeof(FileMetadata));
+
+    if (root->keyCount == 0) {
+        inodeTable.entries[directory] = root->leaf ? NULL : root->children[0];
+        retireMemory(root);
+    }
+}
+
+void initializeInodeState(int inode) {
+    pthread_rwlock_init(&inodeTable.states[inode].lock, NULL);
+    pthread_mutex_init(&inodeTable.states[inode].readaheadLock, NULL);
+}
+
+int allocateInode() {
+    if (inodeTable.freeInodeCount > 0) {
+        return inodeTable.freeInodes[--inodeTable.freeInodeCount];
+    }
+
+    // The table grows by doubling; its region and indexes already have room
+    if (inodeTable.inodeCount == (int) superblock->inodeCapacity) {
+        if (superblock->inodeCapacity == superblock->inodeLimit) {
+            return -1;
+        }
+        uint32_t capacity = superblock->inodeCapacity * 2;
+        superblock->inodeCapacity = (capacity < superblock->inodeLimit) ? capacity : superblock->inodeLimit;
+    }
+
+    inodeTable.inodes[inodeTable.inodeCount].generation = 0;
+    if (inodeTable.states != NULL) {
+        initializeInodeState(inodeTable.inodeCount);
+    }
+    superblock->inodeHighWater = inodeTable.inodeCount + 1;
+    markDirty(superblock, sizeof(Superblock));
+    return inodeTable.inodeCount++;
+}
+
+// Bumping the generation invalidates every dentry cache entry for this inode
+// and makes threads that already resolved it treat the file as gone.
+void retireInode(int inode) {
+    inodeTable.inodes[inode].inUse = 0;
+    inodeTable.inodes[inode].generation++;
+    markDirty(&inodeTable.inodes[inode], sizeof(FileMetadata));
+}
+
+void releaseInode(int inode) {
+    retireInode(inode);
+    inodeTable.freeInodes[inodeTable.freeInodeCount++] = inode;
+}
+
+// Resolves the first depth components of parsed. Returns the inode, -1 if a
+// component does not exist or -2 if a non-final component is not a directory.
+// Lock-free callers pass uncached, which then counts the components that had
+// to be searched instead of adding them to the dentry cache.
+int resolveComponents(ParsedPath *parsed, int depth, int *uncached) {
+    int inode = ROOT_INODE;
+    int resolved = 0;
+
+    // Start from the longest prefix we already know
+    for (int prefix = depth; prefix > 0; prefix--) {
+        int cached = lookupDentry(parsed, prefix);
+        if (cached != -1) {
+            inode = cached;
+            resolved = prefix;
+            break;
+        }
+    }
+
+    char name[MAX_FILENAME_LENGTH];
+    for (int i = resolved; i < depth; i++) {
+        if (inodeTable.inodes[inode].type != FILE_TYPE_DIRECTORY) {
+            return -2;
+        }
+
+        copyComponent(parsed, i, name);
+        inode = searchDirectory(inode, name);
+        if (inode == -1) {
+            return -1;
+        }
+        if (uncached != NULL) {
+            (*uncached)++;
+        } else {
+            insertDentry(parsed, i + 1, inode);
+        }
+    }
+
+    return inode;
+}
+
+int resolvePath(ParsedPath *parsed) {
+    return resolveComponents(parsed, parsed->depth, NULL);
+}
+
+// Resolves parsed without taking fileSystemLock and records the inode's type
+// and generation as of the lookup. Only if writers keep changing the
+// namespace underneath it does it fall back to the lock.
+int lookupPath(ParsedPath *parsed, int *type, uint32_t *generation) {
+    for (int attempt = 0; attempt < LOCKLESS_RETRIES; attempt++) {
+        unsigned long epoch = enterReader();
+        uint32_t sequence = __atomic_load_n(&namespaceSync.sequence, __ATOMIC_ACQUIRE);
+        int inode = -1;
+        int uncached = 0;
+        if ((sequence & 1) == 0) {
+            inode = resolveComponents(parsed, parsed->depth, &uncached);
+            if (inode >= 0) {
+                *type = inodeTable.inodes[inode].type;
+                *generation = inodeTable.inodes[inode].generation;
+            }
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        }
+        int valid = (sequence & 1) == 0 && __atomic_load_n(&namespaceSync.sequence, __ATOMIC_RELAXED) == sequence;
+        leaveReader(epoch);
+
+        if (valid) {
+            __atomic_fetch_add(&namespaceSync.locklessLookups, 1, __ATOMIC_RELAXED);
+            // Warm the dentry cache, but only if nobody is waiting on the lock
+            if (uncached > 0 && inode >= 0 && pthread_mutex_trylock(&fileSystemLock) == 0) {
+                resolvePath(parsed);
+                pthread_mutex_unlock(&fileSystemLock);
+            }
+            return inode;
+        }
+    }
+
+    pthread_mutex_lock(&fileSystemLock);
+    int inode = resolvePath(parsed);
+    if (inode >= 0) {
+        *type = inodeTable.inodes[inode].type;
+        *generation = inodeTable.inodes[inode].generation;
+    }
+    pthread_mutex_unlock(&fileSystemLock);
+    __atomic_fetch_add(&namespaceSync.lockedLookups, 1, __ATOMIC_RELAXED);
+    return inode;
+}
+
+// Resolves everything but the last component, which is copied into name.
+// Returns the parent directory's inode or a negative value if it is missing.
+int resolveParent(ParsedPath *parsed, char *name) {
+    if (parsed->depth == 0) {
+        return -1;
+    }
+
+    int parent = resolveComponents(parsed, parsed->depth - 1, NULL);
+    if (parent < 0 || inodeTable.inodes[parent].type != FILE_TYPE_DIRECTORY) {
+        return -1;
+    }
+
+    copyComponent(parsed, parsed->depth - 1, name);
+    return parent;
+}
+
+void freeEntries(BTreeNode *node) {
+    if (node == NULL) {
+        return;
+    }
+    if (!node->leaf) {
+        for (int i = 0; i <= node->keyCount; i++) {
+            freeEntries(node->children[i]);
+        }
+    }
+    free(node);
+}
+
+// Frees the in-memory indexes built at mount time.
+void freeIndexes() {
+    if (inodeTable.entries != NULL) {
+        for (int i = 0; i < inodeTable.inodeCount; i++) {
+            freeEntries(inodeTable.entries[i]);
+        }
+    }
+    if (inodeTable.states != NULL) {
+        for (int i = 0; i < inodeTable.inodeCount; i++) {
+            pthread_rwlock_destroy(&inodeTable.states[i].lock);
+            pthread_mutex_destroy(&inodeTable.states[i].readaheadLock);
+            for (int j = 0; j < inodeTable.states[i].delayedCount; j++) {
+                free(inodeTable.states[i].delayed[j].data);
+            }
+            free(inodeTable.states[i].delayed);
+        }
+    }
+    releaseArena(inodeTable.entries, inodeTable.inodeLimit, sizeof(BTreeNode *));
+    releaseArena(inodeTable.states, inodeTable.inodeLimit, sizeof(InodeState));
+    releaseArena(inodeTable.freeInodes, inodeTable.inodeLimit, sizeof(int));
+    free(delayedAllocation.inodes);
+    delayedAllocation.inodes = NULL;
+    delayedAllocation.inodeCount = 0;
+    delayedAllocation.inodeCapacity = 0;
+    delayedAllocation.reserved = 0;
+    free(tailStore.blocks);
+    tailStore.blocks = NULL;
+    tailStore.count = 0;
+    tailStore.capacity = 0;
+    releaseArena(dedupIndex.indexed, BITMAP_WORDS(superblock->blockLimit), sizeof(uint64_t));
+    dedupIndex.indexed = NULL;
+    inodeTable.entries = NULL;
+    inodeTable.states = NULL;
+    inodeTable.freeInodes = NULL;
+    stopAllocator();
+
+    for (int i = 0; i < dentryCache.capacity; i++) {
+        free(dentryCache.slots[i].path);
+    }
+    free(dentryCache.slots);
+    dentryCache.slots = NULL;
+    dentryCache.capacity = 0;
+
+    // No readers are left once unmounting
+    for (int i = 0; i < RECLAIM_EPOCHS; i++) {
+        freeRetired(i);
+        free(namespaceSync.retired[i]);
+        namespaceSync.retired[i] = NULL;
+        namespaceSync.retiredCapacity[i] = 0;
+    }
+}
+
+void unmountFileSystem() {
+    stopScrubber();
+    stopIoEngine();
+    stopHandleTable();
+    stopReadahead();
+    if (flushAllDelayed() != 0) {
+        printf("Error: Buffered writes could not all be placed.\n");
+    }
+    stopBufferCache();
+    drainMagazines();
+    syncVolume();
+    superblock->cleanUnmount = 1;
+    markDirty(superblock, sizeof(Superblock));
+    checkpointJournal();
+
+    freeIndexes();
+    unmapVolume();
+}
+
+// Drops the mount the way a crash right after a sync would: every change is
+// committed to the journal, but the image only holds the metadata of the
+// last checkpoint and stays marked unclean, so the next mount replays the
+// journal and rebuilds the bitmap from the inodes.
+void crashFileSystem() {
+    stopScrubber();
+    stopIoEngine();
+    stopHandleTable();
+    stopReadahead();
+    if (flushAllDelayed() != 0) {
+        printf("Error: Buffered writes could not all be placed.\n");
+    }
+    stopBufferCache();
+    drainMagazines();
+    syncVolume();
+
+    freeIndexes();
+    unmapVolume();
+}
+
+// Writes a new, empty file system with the given geometry to the image at
+// path. Returns 0, -1 if the image could not be written or -2 if the
+// geometry is invalid.
+int formatFileSystem(const char *path, VolumeGeometry geometry) {
+    if (geometry.blockCount == 0 || geometry.blockCount > geometry.blockLimit || geometry.inodeCapacity == 0 ||
+        geometry.inodeCapacity > geometry.inodeLimit || geometry.blockLimit > INT32_MAX / 2 ||
+        geometry.inodeLimit > INT32_MAX / 2) {
+        return -2;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    Superblock initial = {0};
+    initial.magic = VOLUME_MAGIC;
+    initial.version = VOLUME_VERSION;
+    initial.features = FEATURE_EXTENTS | FEATURE_JOURNAL | FEATURE_INLINE_DATA | FEATURE_COMPRESSION |
+                       FEATURE_CHECKSUMS | FEATURE_SHARED_BLOCKS;
+    initial.blockSize = DATA_BLOCK_SIZE;
+    initial.blockCount = geometry.blockCount;
+    initial.blockLimit = geometry.blockLimit;
+    initial.inodeCapacity = geometry.inodeCapacity;
+    initial.inodeLimit = geometry.inodeLimit;
+    initial.inodeSize = sizeof(FileMetadata);
+    initial.cleanUnmount = 1;
+    layOutVolume(&initial);
+    initializeChecksums();
+
+    if (ftruncate(fd, initial.volumeSize) != 0 || pwrite(fd, &initial, sizeof(initial), 0) != sizeof(initial) ||
+        mapVolume(fd, initial.volumeSize, mappingSize(&initial)) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (openJournal(path, 1) != 0) {
+        unmapVolume();
+        return -1;
+    }
+
+    inodeTable.inodeCount = 0;
+    int root = allocateInode();
+    FileMetadata *directory = &inodeTable.inodes[root];
+    strcpy(directory->name, "/");
+    directory->permissions = 755;
+    directory->type = FILE_TYPE_DIRECTORY;
+    directory->parent = ROOT_INODE;
+    directory->inUse = 1;
+    markDirty(directory, sizeof(FileMetadata));
+
+    resetFreeMap();
+    sealZeroBlocks(0, geometry.blockCount);
+
+    int errorCode = checkpointJournal();
+    unmapVolume();
+    return errorCode;
+}
+
+// After an unclean shutdown the bitmap may disagree with the inodes, so it
+// is recomputed from the extents of every live file.
+void rebuildFreeMap() {
+    resetFreeMap();
+    loadFreeSpace();
+
+    for (int i = 0; i < inodeTable.inodeCount; i++) {
+        FileMetadata *file = &inodeTable.inodes[i];
+        if (file->inUse && file->type == FILE_TYPE_REGULAR) {
+            for (int j = 0; j < file->extentCount; j++) {
+                markBlocks(fileExtent(file, j)->start, fileExtent(file, j)->length, 0);
+            }
+            if (file->extentCount > MAX_EXTENTS) {
+                markBlocks(file->extentBlock, 1, 0);
+            }
+        }
+    }
+    for (int i = 0; i < tailStore.count; i++) {
+        markBlocks(tailStore.blocks[i].block, 1, 0);
+    }
+}
+
+// Checks the group counters and the volume total against a count of freeMap,
+// and that no block still shared by clones, snapshots or dedup is free.
+// Returns how many groups and shared blocks were off, having repaired them.
+int verifyFreeCounts() {
+    int freedShared = 0;
+    for (int block = 0; block < (int) superblock->blockCount; block++) {
+        if (blockRefs.refs[block] > 0 && (freeSpace.freeMap[block / 64] & (1ULL << (block % 64)))) {
+            markBlocks(block, 1, 0);
+            freedShared++;
+        }
+    }
+    if (freedShared > 0) {
+        printf("Error: %d shared blocks were marked free.\n", freedShared);
+    }
+
+    int wrongGroups = 0;
+    int total = 0;
+    for (int g = 0; g < freeSpace.groupCount; g++) {
+        AllocationGroup *group = &freeSpace.groups[g];
+        int counted = 0;
+        for (int word = group->start / 64; word < (group->end + 63) / 64; word++) {
+            counted += __builtin_popcountll(freeSpace.freeMap[word]);
+        }
+        if (counted != group->freeBlocks) {
+            printf("Error: Group %d counts %d free blocks, its bitmap has %d.\n", g, group->freeBlocks, counted);
+            wrongGroups++;
+        }
+        total += counted;
+    }
+    if (wrongGroups > 0 || total != freeSpace.freeBlocks) {
+        printf("Error: Volume counts %d free blocks, its bitmap has %d.\n", freeSpace.freeBlocks, total);
+        loadFreeSpace();
+    }
+    return wrongGroups + freedShared;
+}
+
+// Data blocks are not journaled, so after an unclean shutdown a block and its
+// checksum may not both have reached the image. Every block in use is sealed
+// again as it is now.
+void resealBlocks() {
+    int blockCount = superblock->blockCount;
+    for (int block = 0; block < blockCount;) {
+        if (freeSpace.freeMap[block / 64] & (1ULL << (block % 64))) {
+            block++;
+            continue;
+        }
+        int end = block + 1;
+        while (end < blockCount && !(freeSpace.freeMap[end / 64] & (1ULL << (end % 64)))) {
+            end++;
+        }
+        sealBlocks(block, end - block);
+        block = end;
+    }
+}
+
+// Opens an existing image. Only the superblock, inode table and bitmap are
+// read; the in-memory indexes are rebuilt from them.
+int mountFileSystem(const char *path) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return -1;
+    }
+
+    Superblock stored;
+    if (pread(fd, &stored, sizeof(stored), 0) != sizeof(stored) || stored.magic != VOLUME_MAGIC ||
+        stored.version != VOLUME_VERSION) {
+        close(fd);
+        return -2;
+    }
+
+    // The image may be longer than the superblock says if a grow was cut
+    // short, which only leaves unused room at the end
+    struct stat image;
+    if (fstat(fd, &image) != 0 || (stored.features & ~SUPPORTED_FEATURES) != 0 ||
+        !validGeometry(&stored, image.st_size) || (size_t) image.st_size > mappingSize(&stored)) {
+        close(fd);
+        return -3;
+    }
+
+    initializeChecksums();
+    if (mapVolume(fd, image.st_size, mappingSize(&stored)) != 0) {
+        close(fd);
+        return -4;
+    }
+
+    // Committed metadata changes that may not have reached the image yet.
+    // They can include a grow, which never moves the regions.
+    if ((stored.features & FEATURE_JOURNAL) && (openJournal(path, 0) != 0 || replayJournal() < 0)) {
+        unmapVolume();
+        return -5;
+    }
+    if (!validGeometry(superblock, volume.size) || superblock->blockLimit != stored.blockLimit ||
+        superblock->inodeLimit != stored.inodeLimit) {
+        unmapVolume();
+        return -3;
+    }
+
+    // Metadata is read right away; the data region is left to page faults
+    madvise(volume.base, stored.dataRegionOffset, MADV_WILLNEED);
+
+    inodeTable.inodeCount = superblock->inodeHighWater;
+    inodeTable.inodeLimit = superblock->inodeLimit;
+    inodeTable.entries = reserveArena(inodeTable.inodeLimit, sizeof(BTreeNode *));
+    inodeTable.states = reserveArena(inodeTable.inodeLimit, sizeof(InodeState));
+    inodeTable.freeInodes = reserveArena(inodeTable.inodeLimit, sizeof(int));
+    if (inodeTable.entries == NULL || inodeTable.states == NULL || inodeTable.freeInodes == NULL ||
+        initializeDentryCache(INITIAL_DENTRY_CACHE_CAPACITY) != 0) {
+        int inodeCount = inodeTable.inodeCount;
+        inodeTable.inodeCount = 0;
+        freeIndexes();
+        inodeTable.inodeCount = inodeCount;
+        unmapVolume();
+        return -4;
+    }
+    for (int i = 0; i < inodeTable.inodeCount; i++) {
+        initializeInodeState(i);
+    }
+    inodeTable.freeInodeCount = 0;
+
+    for (int i = 0; i < inodeTable.inodeCount; i++) {
+        if (inodeTable.inodes[i].type == FILE_TYPE_DIRECTORY) {
+            inodeTable.inodes[i].entryCount = 0;
+        }
+    }
+    for (int i = inodeTable.inodeCount - 1; i >= 0; i--) {
+        FileMetadata *file = &inodeTable.inodes[i];
+        if (!file->inUse) {
+            inodeTable.freeInodes[inodeTable.freeInodeCount++] = i;
+        } else if (i != ROOT_INODE && insertEntry(file->parent, i) != 0) {
+            freeIndexes();
+            unmapVolume();
+            return -4;
+        }
+    }
+
+    // Tail blocks are shared, so which slots are taken comes from the inodes
+    for (int i = 0; i < inodeTable.inodeCount; i++) {
+        FileMetadata *file = &inodeTable.inodes[i];
+        if (file->inUse && (file->flags & FILE_TAIL) &&
+            claimTailSlots(file->tailBlock, tailSlots(file->tailOffset, lastBlockLength(file))) == NULL) {
+            freeIndexes();
+            unmapVolume();
+            return -4;
+        }
+    }
+
+    if (startAllocator() != 0) {
+        freeIndexes();
+        unmapVolume();
+        return -4;
+    }
+    if (superblock->cleanUnmount) {
+        loadFreeSpace();
+    } else {
+        rebuildFreeMap();
+        verifyFreeCounts();
+        resealBlocks();
+    }
+    if (startDedup() != 0) {
+        freeIndexes();
+        unmapVolume();
+        return -4;
+    }
+
+    if (startBufferCache() != 0) {
+        freeIndexes();
+        unmapVolume();
+        return -4;
+    }
+    if (startReadahead() != 0) {
+        stopBufferCache();
+        freeIndexes();
+        unmapVolume();
+        return -4;
+    }
+    if (startIoEngine() != 0) {
+        stopReadahead();
+        stopBufferCache();
+        freeIndexes();
+        unmapVolume();
+        return -4;
+    }
+    if (startHandleTable() != 0) {
+        stopIoEngine();
+        stopReadahead();
+        stopBufferCache();
+        freeIndexes();
+        unmapVolume();
+        return -4;
+    }
+    if (startScrubber() != 0) {
+        stopHandleTable();
+        stopIoEngine();
+        stopReadahead();
+        stopBufferCache();
+        freeIndexes();
+        unmapVolume();
+        return -4;
+    }
+
+    superblock->cleanUnmount = 0;
+    markDirty(superblock, sizeof(Superblock));
+    checkpointJournal();
+    return 0;
+}
+
+// Starts from an empty volume.
+int initializeFileSystem() {
+    VolumeGeometry geometry = {.blockCount = DEFAULT_BLOCK_COUNT,
+                               .blockLimit = DEFAULT_BLOCK_LIMIT,
+                               .inodeCapacity = DEFAULT_INODE_CAPACITY,
+                               .inodeLimit = DEFAULT_INODE_LIMIT};
+    if (formatFileSystem(VOLUME_IMAGE_PATH, geometry) != 0) {
+        return -1;
+    }
+    return mountFileSystem(VOLUME_IMAGE_PATH);
+}
+
+// Adds data blocks to the mounted volume until it has blockCount. The image
+// is extended at the end and the mapping already covers the limit, so no
+// existing block moves. Returns 0, -2 if blockCount is not above the current
+// count or is past the limit, or -1 if the image could not be extended.
+int growVolume(int blockCount) {
+    pthread_mutex_lock(&fileSystemLock);
+    int oldCount = superblock->blockCount;
+    if (blockCount <= oldCount || (uint32_t) blockCount > superblock->blockLimit) {
+        pthread_mutex_unlock(&fileSystemLock);
+        return -2;
+    }
+
+    // The new room is on disk before the journal can mention it
+    size_t size = superblock->dataRegionOffset + (size_t) blockCount * DATA_BLOCK_SIZE;
+    if (ftruncate(volume.fd, size) != 0 || fsync(volume.fd) != 0) {
+        pthread_mutex_unlock(&fileSystemLock);
+        return -1;
+    }
+    pthread_mutex_lock(&volume.syncLock);
+    volume.size = size;
+    pthread_mutex_unlock(&volume.syncLock);
+
+    beginTransaction();
+    superblock->blockCount = blockCount;
+    superblock->volumeSize = size;
+    markDirty(superblock, sizeof(Superblock));
+    sealZeroBlocks(oldCount, blockCount - oldCount);
+
+    // The last group may have been partial; it grows under its lock, and new
+    // groups are set up before allocators can see them
+    int oldGroups = activeGroups();
+    int newGroups = GROUPS_FOR(blockCount);
+    for (int g = oldGroups - 1; g < newGroups; g++) {
+        AllocationGroup *group = &freeSpace.groups[g];
+        pthread_mutex_lock(&group->lock);
+        if (g >= oldGroups) {
+            loadGroup(g);
+        }
+        int start = (oldCount > group->start) ? oldCount : group->start;
+        group->end = (group->start + BLOCKS_PER_GROUP < blockCount) ? group->start + BLOCKS_PER_GROUP : blockCount;
+        markBlocks(start, group->end - start, 1);
+        pthread_mutex_unlock(&group->lock);
+    }
+    __atomic_store_n(&freeSpace.groupCount, newGroups, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&fileSystemLock);
+
+    return commitTransaction();
+}
+
+// Sets whether blocks placed from now on are deduplicated: a block whose
+// contents some indexed block already holds shares that block instead of
+// taking a new one. Returns 0, or -1 if the journal could not be written.
+int setVolumeDedup(int enabled) {
+    beginTransaction();
+    pthread_mutex_lock(&fileSystemLock);
+    superblock->dedupNewBlocks = enabled != 0;
+    markDirty(superblock, sizeof(Superblock));
+    pthread_mutex_unlock(&fileSystemLock);
+    return commitTransaction();
+}
+
+// Sets whether files created from now on are compressed. Returns 0, or -1
+// if the journal could not be written.
+int setVolumeCompression(int enabled) {
+    beginTransaction();
+    pthread_mutex_lock(&fileSystemLock);
+    superblock->compressNewFiles = enabled != 0;
+    markDirty(superblock, sizeof(Superblock));
+    pthread_mutex_unlock(&fileSystemLock);
+    return commitTransaction();
+}
+
+// Allocates an inode for name under parent and links it into the directory.
+// The caller fills in the rest of the metadata inside the same namespace
+// write.
+int linkNewInode(int parent, const char *name, int type, int permissions) {
+    int inode = allocateInode();
+    if (inode == -1) {
+        return -1;
+    }
+
+    FileMetadata *file = &inodeTable.inodes[inode];
+    uint32_t generation = file->generation;
+    memset(file, 0, sizeof(FileMetadata));
+    strcpy(file->name, name);
+    file->permissions = permissions;
+    file->type = type;
+    file->parent = parent;
+    file->generation = generation;
+    file->inUse = 1;
+    markDirty(file, sizeof(FileMetadata));
+    memset(&inodeTable.states[inode].readahead, 0, sizeof(ReadaheadState));
+    inodeTable.states[inode].compressNs = 0;
+    inodeTable.states[inode].expandNs = 0;
+
+    if (insertEntry(parent, inode) != 0) {
+        releaseInode(inode);
+        return -1;
+    }
+    return inode;
+}
+
+int createFile(char *path, int64_t size, int permissions) {
+    ParsedPath parsed;
+    if (parsePath(path, &parsed) != 0) {
+        printf("Error: File name is too long.\n");
+        return -2;
+    }
+
+    if (size <= 0 || size > MAX_FILE_SIZE) {
+        printf("Error: Invalid file size.\n");
+        return -3;
+    }
+
+    // Blocks are allocated on first write, so a new file is one hole
+    beginTransaction();
+    pthread_mutex_lock(&fileSystemLock);
+
+    char name[MAX_FILENAME_LENGTH];
+    int parent = resolveParent(&parsed, name);
+    if (parent < 0) {
+        printf("Error: Parent directory of '%s' not found.\n", path);
+        pthread_mutex_unlock(&fileSystemLock);
+        commitTransaction();
+        return -7;
+    }
+
+    if (inodeTable.inodes[parent].flags & FILE_SNAPSHOT) {
+        printf("Error: '%s' is inside a snapshot.\n", path);
+        pthread_mutex_unlock(&fileSystemLock);
+        commitTransaction();
+        return -10;
+    }
+
+    if (searchDirectory(parent, name) != -1) {
+        printf("Error: File '%s' already exists.\n", path);
+        pthread_mutex_unlock(&fileSystemLock);
+        commitTransaction();
+        return -6;
+    }
+
+    beginNamespaceWrite();
+    int inode = linkNewInode(parent, name, FILE_TYPE_REGULAR, permissions);
+    if (inode == -1) {
+        endNamespaceWrite();
+        printf("Error: Failed to grow the directory.\n");
+        pthread_mutex_unlock(&fileSystemLock);
+        commitTransaction();
+        return -1;
+    }
+
+    FileMetadata *file = &inodeTable.inodes[inode];
+    file->size = size;
+    if (superblock->compressNewFiles) {
+        file->flags |= FILE_COMPRESSED;
+    }
+    markDirty(file, sizeof(FileMetadata));
+    endNamespaceWrite();
+
+    pthread_mutex_unlock(&fileSystemLock);
+
+    // Committed outside the namespace lock so concurrent creates share a flush
+    if (commitTransaction() != 0) {
+        return -1;
+    }
+
+    printf("File '%s' created successfully.\n", path);
+    return 0;
+}
+
+int createDirectory(char *path, int permissions) {
+    ParsedPath parsed;
+    if (parsePath(path, &parsed) != 0) {
+        printf("Error: Directory name is too long.\n");
+        return -2;
+    }
+
+    beginTransaction();
+    pthread_mutex_lock(&fileSystemLock);
+
+    char name[MAX_FILENAME_LENGTH];
+    int parent = resolveParent(&parsed, name);
+    if (parent < 0) {
+        printf("Error: Parent directory of '%s' not found.\n", path);
+        pthread_mutex_unlock(&fileSystemLock);
+        commitTransaction();
+        return -7;
+    }
+
+    if (inodeTable.inodes[parent].flags & FILE_SNAPSHOT) {
+        printf("Error: '%s' is inside a snapshot.\n", path);
+        pthread_mutex_unlock(&fileSystemLock);
+        commitTransaction();
+        return -10;
+    }
+
+    if (searchDirectory(parent, name) != -1) {
+        printf("Error: File '%s' already exists.\n", path);
+        pthread_mutex_unlock(&fileSystemLock);
+        commitTransaction();
+        return -6;
+    }
+
+    beginNamespaceWrite();
+    int inode = linkNewInode(parent, name, FILE_TYPE_DIRECTORY, permissions);
+    endNamespaceWrite();
+    if (inode == -1) {
+        printf("Error: Failed to grow the directory.\n");
+        pthread_mutex_unlock(&fileSystemLock);
+        commitTransaction();
+        return -1;
+    }
+
+    pthread_mutex_unlock(&fileSystemLock);
+
+    if (commitTransaction() != 0) {
+        return -1;
+    }
+
+    printf("Directory '%s' created successfully.\n", path);
+    return 0;
+}
+
+// Appends the entries under node to listing in name order. Returns -1 if more
+// than capacity were found, which a lock-free caller treats as a torn read.
+int copyEntries(BTreeNode *node, ListingEntry *listing, int *count, int capacity) {
+    if (node == NULL) {
+        return 0;
+    }
+
+    for (int i = 0; i <= node->keyCount; i++) {
+        if (!node->leaf && copyEntries(node->children[i], listing, count, capacity) != 0) {
+            return -1;
+        }
+        if (i == node->keyCount) {
+            break;
+        }
+        if (*count == capacity) {
+            return -1;
+        }
+
+        FileMetadata *file = &inodeTable.inodes[node->keys[i]];
+        ListingEntry *entry = &listing[(*count)++];
+        memcpy(entry->name, file->name, MAX_FILENAME_LENGTH);
+        entry->name[MAX_FILENAME_LENGTH - 1] = '\0';
+        entry->type = file->type;
+        entry->size = file->size;
+        entry->permissions = file->permissions;
+    }
+    return 0;
+}
+
+// Copies the directory's entries into a fresh array. Returns the number of
+// entries, -1 if the directory is missing, -2 if the copy was torn by a
+// concurrent writer or -4 if memory ran out.
+int snapshotDirectory(ParsedPath *parsed, ListingEntry **listing) {
+    int uncached = 0;
+    int inode = resolveComponents(parsed, parsed->depth, &uncached);
+    if (inode < 0 || inodeTable.inodes[inode].type != FILE_TYPE_DIRECTORY) {
+        return -1;
+    }
+
+    // Leave room for entries added while copying; running out means a retry
+    int capacity = inodeTable.inodes[inode].entryCount + 16;
+    *listing = malloc(capacity * sizeof(ListingEntry));
+    if (*listing == NULL) {
+        return -4;
+    }
+
+    int count = 0;
+    if (copyEntries(inodeTable.entries[inode], *listing, &count, capacity) != 0) {
+        free(*listing);
+        *listing = NULL;
+        return -2;
+    }
+    return count;
+}
+
+// Copies the listing without taking fileSystemLock and prints it afterwards,
+// so a slow consumer holds up nobody.
+int listDirectory(char *path) {
+    ParsedPath parsed;
+    if (parsePath(path, &parsed) != 0) {
+        printf("Error: Directory '%s' not found.\n", path);
+        return -1;
+    }
+
+    ListingEntry *listing = NULL;
+    int count = -2;
+    for (int attempt = 0; attempt < LOCKLESS_RETRIES && count == -2; attempt++) {
+        unsigned long epoch = enterReader();
+        uint32_t sequence = __atomic_load_n(&namespaceSync.sequence, __ATOMIC_ACQUIRE);
+        if ((sequence & 1) == 0) {
+            count = snapshotDirectory(&parsed, &listing);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        }
+        if ((sequence & 1) != 0 || __atomic_load_n(&namespaceSync.sequence, __ATOMIC_RELAXED) != sequence) {
+            free(listing);
+            listing = NULL;
+            count = -2;
+        }
+        leaveReader(epoch);
+    }
+
+    if (count == -2) {
+        // Writers kept changing the namespace; copy under the lock instead
+        pthread_mutex_lock(&fileSystemLock);
+        count = snapshotDirectory(&parsed, &listing);
+        pthread_mutex_unlock(&fileSystemLock);
+    }
+
+    if (count == -4) {
+        printf("Error: Out of memory listing '%s'.\n", path);
+        return -4;
+    }
+    if (count < 0) {
+        printf("Error: Directory '%s' not found.\n", path);
+        return -1;
+    }
+
+    if (parsed.depth == 0) {
+        printf("Files in the root directory:\n");
+    } else {
+        printf("Files in directory '%s':\n", parsed.text);
+    }
+    for (int i = 0; i < count; i++) {
+        if (listing[i].type == FILE_TYPE_DIRECTORY) {
+            printf("- %s/ (Directory, Permissions: %d)\n", listing[i].name, listing[i].permissions);
+        } else {
+            printf("- %s (Size: %lld bytes, Permissions: %d)\n", listing[i].name, (long long) listing[i].size,
+                   listing[i].permissions);
+        }
+    }
+
+    free(listing);
+    return 0;
+}
+
+void listFiles() {
+    listDirectory("/");
+}
+
+// Prints how many extents files need on average under the current workload.
+void printFragmentationStats() {
+    pthread_mutex_lock(&fileSystemLock);
+
+    int fileCount = 0;
+    int extentTotal = 0;
+    int worstFile = 0;
+    for (int i = 0; i < inodeTable.inodeCount; i++) {
+        FileMetadata *file = &inodeTable.inodes[i];
+        if (!file->inUse || file->type != FILE_TYPE_REGULAR) {
+            continue;
+        }
+        fileCount++;
+        extentTotal += file->extentCount;
+        if (file->extentCount > worstFile) {
+            worstFile = file->extentCount;
+        }
+    }
+
+    double average = (fileCount > 0) ? (double) extentTotal / fileCount : 0.0;
+    printf("Fragmentation: %d files, %d extents, %.2f extents per file (worst %d), %d free blocks\n",
+           fileCount, extentTotal, average, worstFile, countFreeBlocks());
+    int inlineFiles = 0;
+    int tailFiles = 0;
+    for (int i = 0; i < inodeTable.inodeCount; i++) {
+        inlineFiles += inodeTable.inodes[i].inUse && (inodeTable.inodes[i].flags & FILE_INLINE);
+        tailFiles += inodeTable.inodes[i].inUse && (inodeTable.inodes[i].flags & FILE_TAIL);
+    }
+    pthread_mutex_lock(&tailStore.lock);
+    printf("Small files: %d inline, %d packed tails in %d shared blocks\n", inlineFiles, tailFiles, tailStore.count);
+    pthread_mutex_unlock(&tailStore.lock);
+    long expandedBlocks = __atomic_load_n(&compressionStats.expandedBlocks, __ATOMIC_RELAXED);
+    long storedBlocks = __atomic_load_n(&compressionStats.storedBlocks, __ATOMIC_RELAXED);
+    printf("Compression: %ld units of %ld blocks stored in %ld (%.2fx), %ld left raw, %.3f ms compressing, "
+           "%.3f ms expanding %ld units\n",
+           __atomic_load_n(&compressionStats.units, __ATOMIC_RELAXED), expandedBlocks, storedBlocks,
+           (storedBlocks > 0) ? (double) expandedBlocks / storedBlocks : 1.0,
+           __atomic_load_n(&compressionStats.rawUnits, __ATOMIC_RELAXED),
+           __atomic_load_n(&compressionStats.compressNs, __ATOMIC_RELAXED) / 1e6,
+           __atomic_load_n(&compressionStats.expandNs, __ATOMIC_RELAXED) / 1e6,
+           __atomic_load_n(&compressionStats.expansions, __ATOMIC_RELAXED));
+    printf("Dedup: %.2fx, %ld blocks shared by %ld extra references, %ld duplicates found, %ld missed, "
+           "%ld copied on write, %ld of %d index slots in use (%ld replaced)\n",
+           dedupRatio(), __atomic_load_n(&blockRefs.sharedBlocks, __ATOMIC_RELAXED),
+           __atomic_load_n(&blockRefs.extraReferences, __ATOMIC_RELAXED),
+           __atomic_load_n(&dedupIndex.duplicates, __ATOMIC_RELAXED),
+           __atomic_load_n(&dedupIndex.misses, __ATOMIC_RELAXED),
+           __atomic_load_n(&blockRefs.copiedBlocks, __ATOMIC_RELAXED),
+           __atomic_load_n(&dedupIndex.indexedBlocks, __ATOMIC_RELAXED), DEDUP_INDEX_SLOTS, dedupIndex.replaced);
+    printf("Clones: %ld snapshots taken, %ld files cloned sharing %ld blocks, %ld waits for files in use\n",
+           __atomic_load_n(&cloneStats.snapshots, __ATOMIC_RELAXED),
+           __atomic_load_n(&cloneStats.clonedFiles, __ATOMIC_RELAXED),
+           __atomic_load_n(&cloneStats.sharedBlocks, __ATOMIC_RELAXED),
+           __atomic_load_n(&cloneStats.busyWaits, __ATOMIC_RELAXED));
+    pthread_mutex_lock(&delayedAllocation.lock);
+    printf("Delayed allocation: %d blocks buffered, %ld placed in %ld extents over %ld flushes\n",
+           delayedAllocation.reserved, delayedAllocation.placedBlocks, delayedAllocation.placedExtents,
+           delayedAllocation.flushes);
+    pthread_mutex_unlock(&delayedAllocation.lock);
+    printf("Path cache: %ld hits, %ld misses\n", dentryCache.hits, dentryCache.misses);
+    printf("Path lookups: %ld lock-free, %ld under the lock\n", namespaceSync.locklessLookups,
+           namespaceSync.lockedLookups);
+
+    pthread_mutex_unlock(&fileSystemLock);
+}
+
+// Resolves path without the namespace lock, then takes the file's own lock.
+// Returns the inode with its lock held, -1 if the file does not exist or was
+// deleted in between, -3 if it is a directory, -5 if wait is not set and the
+// lock is taken, or -10 if exclusive is set and the file is in a snapshot.
+int lockFile(ParsedPath *parsed, int exclusive, int wait) {
+    int type;
+    uint32_t generation;
+    int inode = lookupPath(parsed, &type, &generation);
+    if (inode < 0) {
+        return -1;
+    }
+    if (type != FILE_TYPE_REGULAR) {
+        return -3;
+    }
+
+    pthread_rwlock_t *lock = &inodeTable.states[inode].lock;
+    if (wait) {
+        if (exclusive) {
+            pthread_rwlock_wrlock(lock);
+        } else {
+            pthread_rwlock_rdlock(lock);
+        }
+    } else if ((exclusive ? pthread_rwlock_trywrlock(lock) : pthread_rwlock_tryrdlock(lock)) != 0) {
+        return -5;
+    }
+
+    FileMetadata *file = &inodeTable.inodes[inode];
+    if (!file->inUse || file->generation != generation) {
+        pthread_rwlock_unlock(lock);
+        return -1;
+    }
+    if (exclusive && (file->flags & FILE_SNAPSHOT)) {
+        pthread_rwlock_unlock(lock);
+        return -10;
+    }
+    return inode;
+}
+
+void unlockFile(int inode) {
+    pthread_rwlock_unlock(&inodeTable.states[inode].lock);
+}
+
+// Binary search of the file's buffered blocks. Returns the one at
+// logicalBlock or NULL, and in position where it is or would go.
+DelayedBlock *findDelayed(InodeState *state, int logicalBlock, int *position) {
+    int low = 0;
+    int high = state->delayedCount;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (state->delayed[middle].logical < logicalBlock) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    *position = low;
+    if (low < state->delayedCount && state->delayed[low].logical == logicalBlock) {
+        return &state->delayed[low];
+    }
+    return NULL;
+}
+
+// Whether the shared block holding the file's packed tail matches its
+// checksum. Taken under the tail lock, as other files' tails may be going in.
+int tailIntact(FileMetadata *file) {
+    pthread_mutex_lock(&tailStore.lock);
+    int intact = blockIntact(file->tailBlock, dataBlocks[file->tailBlock].data);
+    pthread_mutex_unlock(&tailStore.lock);
+    return intact;
+}
+
+// Contents of a block in a hole of the file: inline data or a packed tail,
+// a buffered block, or zeros. Only as much as the file's size covers is
+// valid. Returns NULL if the packed tail fails its checksum. The caller must
+// hold the file's lock.
+const char *holeData(int inode, int logicalBlock) {
+    FileMetadata *file = &inodeTable.inodes[inode];
+    if ((file->flags & (FILE_INLINE | FILE_TAIL)) && logicalBlock == (file->size - 1) / DATA_BLOCK_SIZE) {
+        if (file->flags & FILE_INLINE) {
+            return file->inlineData;
+        }
+        return tailIntact(file) ? dataBlocks[file->tailBlock].data + file->tailOffset : NULL;
+    }
+
+    int position;
+    DelayedBlock *delayed = findDelayed(&inodeTable.states[inode], logicalBlock, &position);
+    return (delayed != NULL) ? delayed->data : zeroBlock;
+}
+
+// Returns the buffer for the block at logicalBlock in a hole of the file,
+// adding a zeroed one if the block was not written yet. Returns NULL if free
+// space cannot hold another buffered block or memory ran out. The caller must
+// hold the file's lock exclusively.
+char *bufferDelayed(int inode, int logicalBlock) {
+    InodeState *state = &inodeTable.states[inode];
+    int position;
+    DelayedBlock *found = findDelayed(state, logicalBlock, &position);
+    if (found != NULL) {
+        return found->data;
+    }
+
+    if (state->delayedCount == state->delayedCapacity) {
+        int capacity = (state->delayedCapacity > 0) ? state->delayedCapacity * 2 : 8;
+        DelayedBlock *grown = realloc(state->delayed, capacity * sizeof(DelayedBlock));
+        if (grown == NULL) {
+            return NULL;
+        }
+        state->delayed = grown;
+        state->delayedCapacity = capacity;
+    }
+    char *data = calloc(1, DATA_BLOCK_SIZE);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&delayedAllocation.lock);
+    int listed = state->delayedCount > 0;
+    if (!listed && delayedAllocation.inodeCount == delayedAllocation.inodeCapacity) {
+        int capacity = (delayedAllocation.inodeCapacity > 0) ? delayedAllocation.inodeCapacity * 2 : 64;
+        int *grown = realloc(delayedAllocation.inodes, capacity * sizeof(int));
+        if (grown != NULL) {
+            delayedAllocation.inodes = grown;
+            delayedAllocation.inodeCapacity = capacity;
+        }
+    }
+    if (availableBlocks() - delayedAllocation.reserved < 1 ||
+        (!listed && delayedAllocation.inodeCount == delayedAllocation.inodeCapacity)) {
+        pthread_mutex_unlock(&delayedAllocation.lock);
+        free(data);
+        return NULL;
+    }
+    if (!listed) {
+        delayedAllocation.inodes[delayedAllocation.inodeCount++] = inode;
+    }
+    int reserved = ++delayedAllocation.reserved;
+    pthread_mutex_unlock(&delayedAllocation.lock);
+
+    // Enough buffered to be worth placing before the flusher's next turn
+    if (reserved == DELAYED_HIGH_WATERMARK) {
+        pthread_cond_signal(&bufferCache.flushNeeded);
+    }
+
+    memmove(state->delayed + position + 1, state->delayed + position,
+            (state->delayedCount - position) * sizeof(DelayedBlock));
+    state->delayed[position] = (DelayedBlock) {.logical = logicalBlock, .data = data};
+    state->delayedCount++;
+    return data;
+}
+
+// Drops count of the file's buffered blocks from position first on, which
+// were placed when placed is set and discarded otherwise, and their
+// reservations. The caller must hold the file's lock exclusively.
+void dropDelayed(int inode, int first, int count, int placed) {
+    InodeState *state = &inodeTable.states[inode];
+    if (count == 0) {
+        return;
+    }
+    for (int i = first; i < first + count; i++) {
+        free(state->delayed[i].data);
+    }
+    state->delayedCount -= count;
+    memmove(state->delayed + first, state->delayed + first + count,
+            (state->delayedCount - first) * sizeof(DelayedBlock));
+
+    pthread_mutex_lock(&delayedAllocation.lock);
+    delayedAllocation.reserved -= count;
+    if (placed) {
+        delayedAllocation.placedBlocks += count;
+    }
+    if (state->delayedCount == 0) {
+        for (int i = 0; i < delayedAllocation.inodeCount; i++) {
+            if (delayedAllocation.inodes[i] == inode) {
+                delayedAllocation.inodes[i] = delayedAllocation.inodes[--delayedAllocation.inodeCount];
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&delayedAllocation.lock);
+
+    if (state->delayedCount == 0) {
+        free(state->delayed);
+        state->delayed = NULL;
+        state->delayedCapacity = 0;
+    }
+}
+
+// getBlocks for expanded blocks of a compressed unit of the file, charging
+// the time spent expanding it to the file.
+int getUnitBlocks(int inode, int64_t key, int count, CacheFrame **frames) {
+    long expandNs = threadExpandNs;
+    int pinned = getBlocks(key, count, 1, frames);
+    __atomic_fetch_add(&inodeTable.states[inode].expandNs, threadExpandNs - expandNs, __ATOMIC_RELAXED);
+    return pinned;
+}
+
+// Pins the blocks under up to length bytes of the file from offset on into
+// view. Returns how many bytes the view covers, which is less than asked at
+// the end of the file or past MAX_VIEW_SPANS blocks, -4 if the cache has no
+// frame to spare, or -11 if a block failed its checksum, in which case
+// nothing stays pinned. The caller must hold the file's lock.
+int pinView(int inode, int64_t offset, int length, FileView *view) {
+    FileMetadata *file = &inodeTable.inodes[inode];
+    view->inode = inode;
+    view->offset = offset;
+    view->length = 0;
+    view->spanCount = 0;
+    if (offset >= file->size || length <= 0) {
+        return 0;
+    }
+
+    int remaining = (length < file->size - offset) ? length : (int) (file->size - offset);
+    int logicalBlock = offset / DATA_BLOCK_SIZE;
+    int skip = offset % DATA_BLOCK_SIZE;
+    while (remaining > 0 && view->spanCount < MAX_VIEW_SPANS) {
+        int64_t block;
+        int wanted = mapRun(file, logicalBlock, skip + remaining, MAX_VIEW_SPANS - view->spanCount, &block);
+        int pinned = wanted;
+        if (block < 0) {
+            // Holes show their buffered blocks, or else the shared zero block
+            for (int i = 0; i < wanted; i++) {
+                view->frames[view->spanCount + i] = NULL;
+            }
+        } else {
+            for (int i = 0; i < wanted && i < MAX_IO_RUN; i++) {
+                updateReadahead(inode, logicalBlock + i);
+            }
+            pinned = (block >= COMPRESSED_KEY_BASE) ? getUnitBlocks(inode, block, wanted, view->frames + view->spanCount)
+                                                    : getBlocks(block, wanted, 1, view->frames + view->spanCount);
+            if (pinned == 0) {
+                break;
+            }
+        }
+
+        for (int i = 0; i < pinned; i++) {
+            int spanLength = DATA_BLOCK_SIZE - skip;
+            if (spanLength > remaining) {
+                spanLength = remaining;
+            }
+            CacheFrame *frame = view->frames[view->spanCount];
+            const char *data = (frame != NULL) ? frame->data : holeData(inode, logicalBlock + i);
+            if (data == NULL || (frame != NULL && frame->corrupt)) {
+                releaseBlocks(view->frames, view->spanCount - i + pinned, 0);
+                view->spanCount = 0;
+                view->length = 0;
+                return -11;
+            }
+            view->spans[view->spanCount].iov_base = (char *) data + skip;
+            view->spans[view->spanCount].iov_len = spanLength;
+            view->spanCount++;
+            view->length += spanLength;
+            remaining -= spanLength;
+            skip = 0;
+        }
+        logicalBlock += pinned;
+    }
+
+    if (view->spanCount == 0 && remaining > 0) {
+        return -4;
+    }
+    return view->length;
+}
+
+void unpinView(FileView *view) {
+    releaseBlocks(view->frames, view->spanCount, 0);
+    view->spanCount = 0;
+}
+
+// Copies up to length bytes of the file from offset on into buffer and
+// returns how many were copied. The caller must hold the file's lock.
+int readLocked(int inode, char *buffer, int length, int64_t offset) {
+    int copied = 0;
+    while (copied < length) {
+        FileView view;
+        int viewLength = pinView(inode, offset + copied, length - copied, &view);
+        if (viewLength <= 0) {
+            return (viewLength < 0) ? viewLength : copied;
+        }
+
+        for (int i = 0; i < view.spanCount; i++) {
+            memcpy(buffer + copied, view.spans[i].iov_base, view.spans[i].iov_len);
+            copied += view.spans[i].iov_len;
+        }
+        unpinView(&view);
+    }
+    return copied;
+}
+
+// Inserts extent among the file's extents in logical order, merging it into
+// the one before when the two are contiguous and neither is compressed. The
+// first extent past MAX_EXTENTS brings in an extent block. Returns 0, or -7
+// if the extents or the space for the block ran out. The caller must hold
+// the file's lock exclusively and be inside a transaction.
+int insertExtent(FileMetadata *file, Extent extent) {
+    int position = file->extentCount;
+    while (position > 0 && fileExtent(file, position - 1)->logical > extent.logical) {
+        position--;
+    }
+
+    if (position > 0) {
+        Extent *previous = fileExtent(file, position - 1);
+        if (previous->start + previous->length == extent.start &&
+            previous->logical + previous->length == extent.logical && !(previous->flags & EXTENT_COMPRESSED) &&
+            !(extent.flags & EXTENT_COMPRESSED)) {
+            previous->length += extent.length;
+            markDirty(previous, sizeof(Extent));
+            return 0;
+        }
+    }
+    if (file->extentCount == MAX_FILE_EXTENTS) {
+        return -7;
+    }
+
+    if (file->extentCount == MAX_EXTENTS) {
+        Extent block;
+        if (allocateExtents(1, &block, 1) != 1) {
+            return -7;
+        }
+        memset(&metadataBlocks[block.start], 0, sizeof(DataBlock));
+        file->extentBlock = block.start;
+    }
+
+    for (int i = file->extentCount; i > position; i--) {
+        *fileExtent(file, i) = *fileExtent(file, i - 1);
+    }
+    *fileExtent(file, position) = extent;
+    file->extentCount++;
+
+    if (file->extentCount > MAX_EXTENTS) {
+        markDirty(&metadataBlocks[file->extentBlock], (file->extentCount - MAX_EXTENTS) * sizeof(Extent));
+    }
+    markDirty(file, sizeof(FileMetadata));
+    return 0;
+}
+
+// Removes extent index from the file, giving back the extent block once the
+// inode holds all the extents again. The caller must hold the file's lock
+// exclusively and be inside a transaction.
+void removeExtent(FileMetadata *file, int index) {
+    for (int i = index; i < file->extentCount - 1; i++) {
+        *fileExtent(file, i) = *fileExtent(file, i + 1);
+    }
+    file->extentCount--;
+
+    if (file->extentCount == MAX_EXTENTS) {
+        Extent block = {.start = file->extentBlock, .length = 1};
+        releaseExtents(&block, 1);
+    } else if (file->extentCount > MAX_EXTENTS) {
+        markDirty(&metadataBlocks[file->extentBlock], (file->extentCount - MAX_EXTENTS) * sizeof(Extent));
+    }
+    markDirty(file, sizeof(FileMetadata));
+}
+
+// Allocates one contiguous run for up to count blocks of the hole at
+// logicalBlock, shrinking the run while free space is too fragmented.
+// Returns how many blocks were mapped, or -7 if none could be.
+int fillHole(FileMetadata *file, int logicalBlock, int count) {
+    Extent extent;
+    while (allocateExtents(count, &extent, 1) != 1) {
+        if (count == 1) {
+            return -7;
+        }
+        count /= 2;
+    }
+
+    extent.logical = logicalBlock;
+    extent.flags = 0;
+    if (insertExtent(file, extent) != 0) {
+        releaseExtents(&extent, 1);
+        return -7;
+    }
+    return count;
+}
+
+// Copies count buffered blocks into the fresh blocks from block on, through
+// the cache while it has room.
+void storeDelayed(int block, DelayedBlock *delayed, int count) {
+    int stored = 0;
+    while (stored < count) {
+        int wanted = (count - stored < MAX_IO_RUN) ? count - stored : MAX_IO_RUN;
+        CacheFrame *frames[MAX_IO_RUN];
+        int pinned = getBlocks(block + stored, wanted, 0, frames);
+        if (pinned == 0) {
+            for (; stored < count; stored++) {
+                memcpy(&dataBlocks[block + stored], delayed[stored].data, DATA_BLOCK_SIZE);
+                markDirty(&dataBlocks[block + stored], DATA_BLOCK_SIZE);
+            }
+            break;
+        }
+        for (int i = 0; i < pinned; i++) {
+            memcpy(frames[i]->data, delayed[stored + i].data, DATA_BLOCK_SIZE);
+        }
+        releaseBlocks(frames, pinned, 1);
+        stored += pinned;
+    }
+}
+
+// Stores the buffered last block of the file inline, or as a packed tail.
+// Returns 0, or -7 if neither fits and it needs a block of its own. The
+// caller must hold the file's lock exclusively and be inside a transaction.
+int packLastBlock(FileMetadata *file, DelayedBlock *last) {
+    int length = lastBlockLength(file);
+    if (file->extentCount == 0 && file->size <= INLINE_DATA_SIZE) {
+        memcpy(file->inlineData, last->data, length);
+        file->flags |= FILE_INLINE;
+        __atomic_fetch_add(&tailStore.inlinedFiles, 1, __ATOMIC_RELAXED);
+    } else if (length <= MAX_TAIL_LENGTH && allocateTail(length, &file->tailBlock, &file->tailOffset) == 0) {
+        // Sealed under the tail lock, as other tails may be going into the block
+        char *tail = dataBlocks[file->tailBlock].data + file->tailOffset;
+        pthread_mutex_lock(&tailStore.lock);
+        memcpy(tail, last->data, length);
+        markDirty(tail, length);
+        pthread_mutex_unlock(&tailStore.lock);
+        file->flags |= FILE_TAIL;
+        __atomic_fetch_add(&tailStore.packedTails, 1, __ATOMIC_RELAXED);
+    } else {
+        return -7;
+    }
+    markDirty(file, sizeof(FileMetadata));
+    return 0;
+}
+
+// Compresses each unit of the file that only holds buffered blocks and
+// holes into one run of fewer blocks, written straight to the image. Units
+// that would not save a block are left for flushDelayed to place as they
+// are. Returns how many units were stored. The caller must hold the file's
+// lock exclusively and be inside a transaction.
+int compressDelayed(int inode) {
+    InodeState *state = &inodeTable.states[inode];
+    FileMetadata *file = &inodeTable.inodes[inode];
+    char expanded[COMPRESSION_UNIT_SIZE];
+    char packed[COMPRESSION_UNIT_SIZE];
+
+    int units = 0;
+    int first = 0;
+    while (first < state->delayedCount) {
+        int unitStart = state->delayed[first].logical / COMPRESSION_UNIT_BLOCKS * COMPRESSION_UNIT_BLOCKS;
+        int end = first;
+        while (end < state->delayedCount && state->delayed[end].logical < unitStart + COMPRESSION_UNIT_BLOCKS) {
+            end++;
+        }
+
+        // Only the bytes up to the end of the file are kept
+        int64_t unitBytes = file->size - (int64_t) unitStart * DATA_BLOCK_SIZE;
+        int length = (unitBytes < COMPRESSION_UNIT_SIZE) ? (int) unitBytes : COMPRESSION_UNIT_SIZE;
+        int blocks = (length + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+        int eligible = blocks > 1 && state->delayed[end - 1].logical < unitStart + blocks;
+        for (int logical = unitStart; eligible && logical < unitStart + blocks;) {
+            int run;
+            eligible = mapLogicalBlock(file, logical, &run) < 0;
+            logical += run;
+        }
+        if (!eligible) {
+            first = end;
+            continue;
+        }
+
+        memset(expanded, 0, blocks * DATA_BLOCK_SIZE);
+        for (int i = first; i < end; i++) {
+            memcpy(expanded + (state->delayed[i].logical - unitStart) * DATA_BLOCK_SIZE, state->delayed[i].data,
+                   DATA_BLOCK_SIZE);
+        }
+        long started = threadCpuNs();
+        int capacity = (blocks - 1) * DATA_BLOCK_SIZE - (int) sizeof(UnitHeader);
+        int stored = compressBytes(expanded, length, packed + sizeof(UnitHeader), capacity);
+        long elapsed = threadCpuNs() - started;
+        __atomic_fetch_add(&state->compressNs, elapsed, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&compressionStats.compressNs, elapsed, __ATOMIC_RELAXED);
+
+        Extent extent;
+        int storedBlocks = (stored < 0) ? 0 : ((int) sizeof(UnitHeader) + stored + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+        if (stored < 0 || allocateExtents(storedBlocks, &extent, 1) != 1) {
+            __atomic_fetch_add(&compressionStats.rawUnits, 1, __ATOMIC_RELAXED);
+            first = end;
+            continue;
+        }
+
+        UnitHeader header = {.storedLength = stored, .expandedLength = length};
+        memcpy(packed, &header, sizeof(header));
+        memset(packed + sizeof(header) + stored, 0, storedBlocks * DATA_BLOCK_SIZE - sizeof(header) - stored);
+        memcpy(&dataBlocks[extent.start], packed, storedBlocks * DATA_BLOCK_SIZE);
+        markDirty(&dataBlocks[extent.start], storedBlocks * DATA_BLOCK_SIZE);
+
+        extent.logical = unitStart;
+        extent.flags = EXTENT_COMPRESSED;
+        if (insertExtent(file, extent) != 0) {
+            releaseExtents(&extent, 1);
+            break;
+        }
+        dropDelayed(inode, first, end - first, 1);
+        units++;
+        __atomic_fetch_add(&compressionStats.units, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&compressionStats.expandedBlocks, blocks, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&compressionStats.storedBlocks, storedBlocks, __ATOMIC_RELAXED);
+    }
+    return units;
+}
+
+// Maps the buffered block to an indexed block with the same contents and
+// returns 1, or returns 0 if there is none, or -7 if the extent slots ran
+// out. The block's fingerprint is left in fingerprint. The caller must hold
+// the file's lock exclusively and be inside a transaction.
+int shareDelayed(FileMetadata *file, DelayedBlock *delayed, uint32_t *fingerprint) {
+    *fingerprint = crc32c(delayed->data, DATA_BLOCK_SIZE);
+    pthread_mutex_lock(&blockRefs.lock);
+    int block = findDuplicate(delayed->data, *fingerprint);
+    if (block >= 0) {
+        addReferences(block, 1);
+    }
+    pthread_mutex_unlock(&blockRefs.lock);
+    if (block < 0) {
+        __atomic_fetch_add(&dedupIndex.misses, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    Extent extent = {.start = block, .length = 1, .logical = delayed->logical, .flags = 0};
+    if (insertExtent(file, extent) != 0) {
+        releaseExtents(&extent, 1);
+        return -7;
+    }
+    __atomic_fetch_add(&dedupIndex.duplicates, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Places the file's buffered blocks, giving each run of consecutive logical
+// blocks one contiguous extent unless free space is too fragmented. Units of
+// a compressed file are compressed first where that saves space. With dedup
+// on, blocks go one at a time so each can share a block placed before it,
+// even one of the same flush. With pack set, a partial last block goes
+// inline or into a shared tail block when it is small enough. Returns 0, or
+// -7 if the space or extent slots ran out, in which case the blocks not yet
+// placed stay buffered. The caller must hold the file's lock exclusively and
+// be inside a transaction.
+int flushDelayed(int inode, int pack) {
+    InodeState *state = &inodeTable.states[inode];
+    FileMetadata *file = &inodeTable.inodes[inode];
+    if (state->delayedCount == 0) {
+        return 0;
+    }
+
+    int extents = (file->flags & FILE_COMPRESSED) ? compressDelayed(inode) : 0;
+    int dedup = superblock->dedupNewBlocks;
+    int runs = state->delayedCount;
+    if (pack && runs > 0 && state->delayed[runs - 1].logical == (file->size - 1) / DATA_BLOCK_SIZE &&
+        lastBlockLength(file) < DATA_BLOCK_SIZE) {
+        runs--;
+    }
+
+    int placed = 0;
+    int result = 0;
+    while (placed < state->delayedCount) {
+        DelayedBlock *first = &state->delayed[placed];
+        if (placed == runs) {
+            if (packLastBlock(file, first) == 0) {
+                dropDelayed(inode, 0, placed, 1);
+                dropDelayed(inode, 0, 1, 0);
+                placed = 0;
+                break;
+            }
+            runs++;
+        }
+
+        uint32_t fingerprint = 0;
+        if (dedup) {
+            int shared = shareDelayed(file, first, &fingerprint);
+            if (shared < 0) {
+                result = shared;
+                break;
+            }
+            if (shared > 0) {
+                placed++;
+                continue;
+            }
+        }
+
+        int runLength = 1;
+        while (!dedup && placed + runLength < runs && first[runLength].logical == first->logical + runLength) {
+            runLength++;
+        }
+
+        int filled = fillHole(file, first->logical, runLength);
+        if (filled < 0) {
+            result = filled;
+            break;
+        }
+        int run;
+        int block = (int) mapLogicalBlock(file, first->logical, &run);
+        storeDelayed(block, first, filled);
+        if (dedup) {
+            pthread_mutex_lock(&blockRefs.lock);
+            indexBlock(block, fingerprint);
+            pthread_mutex_unlock(&blockRefs.lock);
+        }
+        placed += filled;
+        extents++;
+    }
+
+    if (placed > 0) {
+        dropDelayed(inode, 0, placed, 1);
+    }
+    pthread_mutex_lock(&delayedAllocation.lock);
+    delayedAllocation.flushes++;
+    delayedAllocation.placedExtents += extents;
+    pthread_mutex_unlock(&delayedAllocation.lock);
+    return result;
+}
+
+// Moves inline data or a packed tail back into a buffered block, so the file
+// can be written and resized like any other. Returns 0, -7 if the block
+// could not be buffered or -11 if the tail failed its checksum. The caller
+// must hold the file's lock exclusively and be inside a transaction.
+int unpackFile(int inode) {
+    FileMetadata *file = &inodeTable.inodes[inode];
+    if (!(file->flags & (FILE_INLINE | FILE_TAIL))) {
+        return 0;
+    }
+    if ((file->flags & FILE_TAIL) && !tailIntact(file)) {
+        return -11;
+    }
+
+    int length = lastBlockLength(file);
+    char *data = bufferDelayed(inode, (int) ((file->size - 1) / DATA_BLOCK_SIZE));
+    if (data == NULL) {
+        return -7;
+    }
+    if (file->flags & FILE_INLINE) {
+        memcpy(data, file->inlineData, length);
+        memset(file->inlineData, 0, INLINE_DATA_SIZE);
+    } else {
+        memcpy(data, dataBlocks[file->tailBlock].data + file->tailOffset, length);
+        releaseTail(file->tailBlock, file->tailOffset, length);
+    }
+    file->flags &= ~(FILE_INLINE | FILE_TAIL);
+    markDirty(file, sizeof(FileMetadata));
+    return 0;
+}
+
+// Moves the compressed unit holding logicalBlock back into buffered blocks
+// and frees its run, so it can be written like a hole; flushDelayed
+// compresses it again. Returns 0, -7 if the blocks could not be buffered or
+// -11 if the unit failed its checksum, in which case the unit stays as it
+// was. The caller must hold the file's lock exclusively and be inside a
+// transaction.
+int unpackUnit(int inode, int logicalBlock) {
+    InodeState *state = &inodeTable.states[inode];
+    FileMetadata *file = &inodeTable.inodes[inode];
+    int index = findExtent(file, logicalBlock);
+    Extent unit = *fileExtent(file, index);
+
+    char expanded[COMPRESSION_UNIT_SIZE];
+    long expandNs = threadExpandNs;
+    int length = expandUnit(unit.start, expanded);
+    __atomic_fetch_add(&state->expandNs, threadExpandNs - expandNs, __ATOMIC_RELAXED);
+    if (length < 0) {
+        return -11;
+    }
+
+    // Nothing is buffered inside a mapped unit, so its blocks go in together
+    int position;
+    findDelayed(state, unit.logical, &position);
+    int blocks = (length + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+    for (int i = 0; i < blocks; i++) {
+        char *data = bufferDelayed(inode, unit.logical + i);
+        if (data == NULL) {
+            dropDelayed(inode, position, i, 0);
+            return -7;
+        }
+        memcpy(data, expanded + i * DATA_BLOCK_SIZE, DATA_BLOCK_SIZE);
+    }
+
+    removeExtent(file, index);
+    releaseExtents(&unit, 1);
+    return 0;
+}
+
+// Unmaps logicalBlock from the raw extent holding it, without freeing its
+// block, splitting the extent when the block is in its middle. Returns 0, or
+// -7 if the extent slots or the space for an extent block ran out, in which
+// case nothing changed. The caller must hold the file's lock exclusively and
+// be inside a transaction.
+int punchBlock(FileMetadata *file, int logicalBlock) {
+    int index = findExtent(file, logicalBlock);
+    Extent *extent = fileExtent(file, index);
+    int offset = logicalBlock - extent->logical;
+    if (extent->length == 1) {
+        removeExtent(file, index);
+        return 0;
+    }
+
+    Extent rest = {.start = extent->start + offset + 1,
+                   .length = extent->length - offset - 1,
+                   .logical = logicalBlock + 1,
+                   .flags = 0};
+    if (offset == 0) {
+        *extent = rest;
+    } else {
+        extent->length = offset;
+    }
+    markDirty(extent, sizeof(Extent));
+    if (offset > 0 && rest.length > 0 && insertExtent(file, rest) != 0) {
+        extent->length += 1 + rest.length;
+        markDirty(extent, sizeof(Extent));
+        return -7;
+    }
+    return 0;
+}
+
+// Gives the file its own copy of block, a block it shares at logicalBlock:
+// the contents move into a buffered block and the file's reference is
+// dropped, so the block is written like a hole and placed anew on flush.
+// Returns 0, -4 if the cache is full, -7 if the block could not be buffered
+// or unmapped, or -11 if it failed its checksum. The caller must hold the
+// file's lock exclusively and be inside a transaction.
+int unshareBlock(int inode, int logicalBlock, int block) {
+    CacheFrame *frame = getBlock(block, 1);
+    if (frame == NULL) {
+        return -4;
+    }
+    char *data = frame->corrupt ? NULL : bufferDelayed(inode, logicalBlock);
+    if (data != NULL) {
+        memcpy(data, frame->data, DATA_BLOCK_SIZE);
+    }
+    int corrupt = frame->corrupt;
+    releaseBlock(frame, 0);
+    if (data == NULL) {
+        return corrupt ? -11 : -7;
+    }
+
+    if (punchBlock(&inodeTable.inodes[inode], logicalBlock) != 0) {
+        int position;
+        findDelayed(&inodeTable.states[inode], logicalBlock, &position);
+        dropDelayed(inode, position, 1, 0);
+        return -7;
+    }
+    Extent extent = {.start = block, .length = 1};
+    releaseExtents(&extent, 1);
+    __atomic_fetch_add(&blockRefs.copiedBlocks, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Places the buffered blocks of every file. Returns 0, -7 if some stay
+// buffered for lack of space, or -1 if the journal could not be written.
+int flushAllDelayed() {
+    pthread_mutex_lock(&delayedAllocation.lock);
+    int count = delayedAllocation.inodeCount;
+    int *inodes = (count > 0) ? malloc(count * sizeof(int)) : NULL;
+    if (inodes != NULL) {
+        memcpy(inodes, delayedAllocation.inodes, count * sizeof(int));
+    }
+    pthread_mutex_unlock(&delayedAllocation.lock);
+    if (inodes == NULL) {
+        return (count > 0) ? -1 : 0;
+    }
+
+    int result = 0;
+    beginTransaction();
+    for (int i = 0; i < count; i++) {
+        pthread_rwlock_wrlock(&inodeTable.states[inodes[i]].lock);
+        if (flushDelayed(inodes[i], 1) != 0) {
+            result = -7;
+        }
+        pthread_rwlock_unlock(&inodeTable.states[inodes[i]].lock);
+    }
+    free(inodes);
+
+    if (commitTransaction() != 0) {
+        return -1;
+    }
+    return result;
+}
+
+// Copies up to length bytes of buffer into the file, starting skip bytes into
+// the block at logicalBlock and stopping at the end of that block's run.
+// Mapped blocks are written through the cache. Holes are buffered and only
+// get blocks when flushDelayed places them, and so are compressed units once
+// expanded and blocks shared with other files once copied. Blocks written in
+// part keep the rest of their contents if keepRest is set and are
+// zero-filled otherwise; a corrupt block is not written in part. Returns how
+// many bytes were written, -4 if the cache is full, -7 if the space ran out
+// or -11 if the first block failed its checksum. The caller must hold the
+// file's lock exclusively and be inside a transaction.
+int writeRun(int inode, int logicalBlock, int skip, const char *buffer, int length, int keepRest) {
+    FileMetadata *file = &inodeTable.inodes[inode];
+    int64_t block;
+    int wanted = mapRun(file, logicalBlock, skip + length, MAX_IO_RUN, &block);
+    if (block >= COMPRESSED_KEY_BASE) {
+        int result = unpackUnit(inode, logicalBlock);
+        if (result != 0) {
+            return result;
+        }
+        wanted = mapRun(file, logicalBlock, skip + length, MAX_IO_RUN, &block);
+    }
+    if (block >= 0) {
+        int owned = ownBlocks(block, wanted);
+        if (owned == 0) {
+            int result = unshareBlock(inode, logicalBlock, block);
+            if (result != 0) {
+                return result;
+            }
+            wanted = mapRun(file, logicalBlock, skip + length, MAX_IO_RUN, &block);
+        } else {
+            wanted = owned;
+        }
+    }
+
+    char *targets[MAX_IO_RUN];
+    CacheFrame *frames[MAX_IO_RUN];
+    int count = 0;
+    if (block < 0) {
+        for (; count < wanted; count++) {
+            targets[count] = bufferDelayed(inode, logicalBlock + count);
+            if (targets[count] == NULL) {
+                break;
+            }
+        }
+        if (count == 0) {
+            return -7;
+        }
+    } else {
+        int partial = skip != 0 || skip + length < wanted * DATA_BLOCK_SIZE;
+        count = getBlocks(block, wanted, keepRest && partial, frames);
+        if (count == 0) {
+            return -4;
+        }
+        for (int i = 0; i < count; i++) {
+            targets[i] = frames[i]->data;
+        }
+    }
+
+    int written = 0;
+    int used = 0;
+    for (; used < count && written < length; used++) {
+        int chunk = (DATA_BLOCK_SIZE - skip < length - written) ? DATA_BLOCK_SIZE - skip : length - written;
+        if (block >= 0 && keepRest && chunk < DATA_BLOCK_SIZE && frames[used]->corrupt) {
+            break;
+        }
+        memcpy(targets[used] + skip, buffer + written, chunk);
+        if (!keepRest) {
+            memset(targets[used] + skip + chunk, 0, DATA_BLOCK_SIZE - skip - chunk);
+        }
+        written += chunk;
+        skip = 0;
+    }
+    if (block >= 0) {
+        releaseBlocks(frames, used, 1);
+        releaseBlocks(frames + used, count - used, 0);
+    }
+    return (written > 0 || used == count) ? written : -11;
+}
+
+// Overwrites the start of the file with length bytes of content, zero-filling
+// the rest of the last block. Content past the end of the file is dropped.
+// Returns 0, -4 if the cache is full, -7 if the space ran out or -11 if a
+// block failed its checksum. The caller must hold the file's lock
+// exclusively and be inside a transaction.
+int writeLocked(int inode, const char *content, int length) {
+    FileMetadata *file = &inodeTable.inodes[inode];
+    int unpacked = unpackFile(inode);
+    if (unpacked != 0) {
+        return unpacked;
+    }
+
+    int contentLength = (length < file->size) ? length : (int) file->size;
+    int logicalBlock = 0;
+    int written = 0;
+    while (written < contentLength) {
+        // Every block written is overwritten in full, so nothing needs loading
+        int result = writeRun(inode, logicalBlock, 0, content + written, contentLength - written, 0);
+        if (result < 0) {
+            return result;
+        }
+        written += result;
+        logicalBlock += (result + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+    }
+    return 0;
+}
+
+// Runs request on the calling thread and returns its result.
+int executeIo(IoRequest *request) {
+    ParsedPath parsed;
+    if (parsePath(request->path, &parsed) != 0) {
+        return -1;
+    }
+
+    if (request->opcode == IO_OP_READ) {
+        int inode = lockFile(&parsed, 0, 1);
+        if (inode < 0) {
+            return inode;
+        }
+        int result = readLocked(inode, request->buffer, request->length, 0);
+        unlockFile(inode);
+        return result;
+    }
+
+    // Unpacking a small file changes its inode, which is journaled
+    beginTransaction();
+    int inode = lockFile(&parsed, 1, 1);
+    if (inode < 0) {
+        commitTransaction();
+        return inode;
+    }
+    int result = writeLocked(inode, request->buffer, request->length);
+    unlockFile(inode);
+    if (commitTransaction() != 0) {
+        return -1;
+    }
+    return result;
+}
+
+int readFile(char *path) {
+    ParsedPath parsed;
+    if (parsePath(path, &parsed) != 0) {
+        printf("Error: File '%s' not found.\n", path);
+        return -1;
+    }
+
+    int inode = lockFile(&parsed, 0, 1);
+    if (inode == -1) {
+        printf("Error: File '%s' not found.\n", path);
+        return -1;
+    }
+    if (inode == -3) {
+        printf("Error: '%s' is a directory.\n", path);
+        return -3;
+    }
+
+    // Printing stops at the first NUL, as the file holds text
+    int errorCode = 0;
+    int64_t offset = 0;
+    int done = 0;
+    while (!done) {
+        FileView view;
+        int length = pinView(inode, offset, MAX_VIEW_SPANS * DATA_BLOCK_SIZE, &view);
+        if (length == -11) {
+            printf("Error: File '%s' is corrupt.\n", path);
+            errorCode = -11;
+            break;
+        }
+        if (length < 0) {
+            printf("Error: Buffer cache is full.\n");
+            errorCode = -4;
+            break;
+        }
+
+        for (int i = 0; i < view.spanCount && !done; i++) {
+            size_t textLength = strnlen(view.spans[i].iov_base, view.spans[i].iov_len);
+            fwrite(view.spans[i].iov_base, sizeof(char), textLength, stdout);
+            done = textLength < view.spans[i].iov_len;
+        }
+        unpinView(&view);
+
+        offset += length;
+        done = done || length == 0;
+    }
+
+    unlockFile(inode);
+
+    return errorCode;
+}
+
+// Opens a read-only view of up to length bytes of the file at path from
+// offset on, holding the file's shared lock until releaseView. Returns the
+// number of bytes covered, which may be less than asked and is 0 past the end
+// of the file, or -1 if the file does not exist, -3 if it is a directory or
+// -4 if the cache is full. Unless it fails, the view must be released.
+int viewFile(char *path, int64_t offset, int length, FileView *view) {
+    ParsedPath parsed;
+    if (parsePath(path, &parsed) != 0) {
+        return -1;
+    }
+
+    int inode = lockFile(&parsed, 0, 1);
+    if (inode < 0) {
+        return inode;
+    }
+
+    int result = pinView(inode, offset, length, view);
+    if (result < 0) {
+        unlockFile(inode);
+    }
+    return result;
+}
+
+void releaseView(FileView *view) {
+    unpinView(view);
+    unlockFile(view->inode);
+}
+
+// Hashes the whole file straight out of the cache. Returns 0 and the hash in
+// hash, -1 if the file does not exist, -3 if it is a directory or -4 if the
+// cache is full.
+int checksumFile(char *path, uint32_t *hash) {
+    ParsedPath parsed;
+    if (parsePath(path, &parsed) != 0) {
+        return -1;
+    }
+
+    int inode = lockFile(&parsed, 0, 1);
+    if (inode < 0) {
+        return inode;
+    }
+
+    *hash = 2166136261u;
+    int64_t offset = 0;
+    int length;
+    do {
+        FileView view;
+        length = pinView(inode, offset, MAX_VIEW_SPANS * DATA_BLOCK_SIZE, &view);
+        for (int i = 0; i < view.spanCount; i++) {
+            *hash = hashBytes(*hash, view.spans[i].iov_base, view.spans[i].iov_len);
+        }
+        unpinView(&view);
+        offset += length;
+    } while (length > 0);
+
+    unlockFile(inode);
+    return (length < 0) ? length : 0;
+}
+
+// Like readFile, but copies the contents into buffer instead of printing them.
+// Returns the number of bytes copied.
+int readFileInto(char *path, char *buffer, int bufferSize) {
+    IoRequest request = {.opcode = IO_OP_READ, .path = path, .buffer = buffer, .length = bufferSize};
+    return executeIo(&request);
+}
+
+int writeFile(char *path, char *content) {
+    IoRequest request = {.opcode = IO_OP_WRITE, .path = path, .buffer = content, .length = strlen(content)};
+    int errorCode = executeIo(&request);
+    if (errorCode == -1) {
+        printf("Error: File '%s' not found.\n", path);
+    } else if (errorCode == -3) {
+        printf("Error: '%s' is a directory.\n", path);
+    } else if (errorCode == -4) {
+        printf("Error: Buffer cache is full.\n");
+    } else if (errorCode == -10) {
+        printf("Error: File '%s' is in a snapshot.\n", path);
+    } else if (errorCode == -11) {
+        printf("Error: File '%s' is corrupt.\n", path);
+    }
+    return errorCode;
+}
+
+// Hands a finished request back through its callback or the completion queue.
+void completeIo(IoRequest *request, int result) {
+    request->result = result;
+    if (request->callback != NULL) {
+        request->callback(request);
+        return;
+    }
+
+    pthread_mutex_lock(&ioEngine.lock);
+    request->next = NULL;
+    if (ioEngine.completedTail != NULL) {
+        ioEngine.completedTail->next = request;
+    } else {
+        ioEngine.completed = request;
+    }
+    ioEngine.completedTail = request;
+    pthread_cond_broadcast(&ioEngine.completion);
+    pthread_mutex_unlock(&ioEngine.lock);
+}
+
+int setupRing(IoRing *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sqRing != MAP_FAILED) {
+            munmap(ring->sqRing, ring->sqRingSize);
+        }
+        if (ring->cqRing != MAP_FAILED) {
+            munmap(ring->cqRing, ring->cqRingSize);
+        }
+        if (ring->sqes != MAP_FAILED) {
+            munmap(ring->sqes, ring->sqesSize);
+        }
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = ring->sqRing;
+    char *cq = ring->cqRing;
+    ring->sqHead = (unsigned *) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *) (sq + params.sq_off.array);
+    ring->cqHead = (unsigned *) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring->unsubmitted = 0;
+    return 0;
+}
+
+void teardownRing(IoRing *ring) {
+    munmap(ring->sqes, ring->sqesSize);
+    munmap(ring->cqRing, ring->cqRingSize);
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+}
+
+// Passes queued entries to the kernel and, if wait is set, sleeps until at
+// least one completion is posted.
+void enterRing(IoRing *ring, int wait) {
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    int result = syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, wait ? 1 : 0, flags, NULL, 0);
+    if (result > 0) {
+        ring->unsubmitted -= result;
+    }
+}
+
+// Returns a cleared submission entry tagged with userData, making room first
+// if the ring is full.
+struct io_uring_sqe *queueSqe(IoRing *ring, uint64_t userData) {
+    unsigned tail = *ring->sqTail;
+    while (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) > ring->sqMask) {
+        enterRing(ring, 0);
+    }
+
+    unsigned index = tail & ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = userData;
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->unsubmitted++;
+    return sqe;
+}
+
+// Completions that are not block transfers carry these tags.
+#define IO_TAG_EVENT 1
+#define IO_TAG_TIMEOUT 2
+
+void armEventPoll() {
+    struct io_uring_sqe *sqe = queueSqe(&ioEngine.ring, IO_TAG_EVENT);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ioEngine.eventFd;
+    sqe->poll_events = POLLIN;
+}
+
+void pushRequest(IoRequest **list, IoRequest *request) {
+    request->next = *list;
+    *list = request;
+}
+
+// Submits one readv per run of blocks this request had to add to the cache.
+void queueTransfers(IoRequest *request) {
+    int transferCount = 0;
+    for (int i = 0; i < request->pinned;) {
+        if (!request->inserted[i]) {
+            i++;
+            continue;
+        }
+
+        int first = i;
+        while (i < request->pinned && request->inserted[i]) {
+            request->vectors[i].iov_base = request->frames[i]->data;
+            request->vectors[i].iov_len = DATA_BLOCK_SIZE;
+            i++;
+        }
+
+        IoTransfer *transfer = &request->transfers[transferCount++];
+        transfer->request = request;
+        transfer->first = first;
+        transfer->count = i - first;
+
+        struct io_uring_sqe *sqe = queueSqe(&ioEngine.ring, (uint64_t) (uintptr_t) transfer);
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = volume.fd;
+        sqe->addr = (uint64_t) (uintptr_t) &request->vectors[first];
+        sqe->len = transfer->count;
+        sqe->off = superblock->dataRegionOffset + (uint64_t) request->frames[first]->block * DATA_BLOCK_SIZE;
+        __atomic_fetch_add(&ioEngine.ringTransfers, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Marks a transfer's frames loaded, copying whatever a short read left out
+// straight from the mapping, and checks them.
+void finishTransfer(IoTransfer *transfer, int result) {
+    IoRequest *request = transfer->request;
+    int done = (result > 0) ? result / DATA_BLOCK_SIZE : 0;
+    for (int i = done; i < transfer->count; i++) {
+        CacheFrame *frame = request->frames[transfer->first + i];
+        memcpy(frame->data, dataBlocks[frame->block].data, DATA_BLOCK_SIZE);
+    }
+    int intact[MAX_IO_RUN];
+    for (int i = 0; i < transfer->count; i++) {
+        CacheFrame *frame = request->frames[transfer->first + i];
+        intact[i] = blockIntact(frame->block, frame->data);
+    }
+
+    pthread_mutex_lock(&bufferCache.lock);
+    for (int i = 0; i < transfer->count; i++) {
+        request->frames[transfer->first + i]->corrupt = !intact[i];
+        request->frames[transfer->first + i]->loading = 0;
+    }
+    pthread_cond_broadcast(&bufferCache.frameLoaded);
+    pthread_mutex_unlock(&bufferCache.lock);
+}
+
+int framesLoading(IoRequest *request) {
+    pthread_mutex_lock(&bufferCache.lock);
+    int loading = 0;
+    for (int i = 0; i < request->pinned && !loading; i++) {
+        loading = request->frames[i]->loading;
+    }
+    pthread_mutex_unlock(&bufferCache.lock);
+    return loading;
+}
+
+// Moves an asynchronous read forward until it has to wait for the ring, or
+// for frames when the cache is full, or until it is done.
+void advanceRead(IoRequest *request) {
+    FileMetadata *file = &inodeTable.inodes[request->inode];
+
+    while (1) {
+        if (request->pinned > 0) {
+            int corrupt = 0;
+            for (int i = 0; i < request->pinned; i++) {
+                corrupt = corrupt || request->frames[i]->corrupt;
+            }
+            if (corrupt) {
+                releaseBlocks(request->frames, request->pinned, 0);
+                request->pinned = 0;
+                unlockFile(request->inode);
+                completeIo(request, -11);
+                return;
+            }
+            for (int i = 0; i < request->pinned; i++) {
+                int length = (request->remaining < DATA_BLOCK_SIZE) ? request->remaining : DATA_BLOCK_SIZE;
+                memcpy(request->buffer + request->copied, request->frames[i]->data, length);
+                request->copied += length;
+                request->remaining -= length;
+            }
+            releaseBlocks(request->frames, request->pinned, 0);
+            request->logicalBlock += request->pinned;
+            request->pinned = 0;
+        }
+
+        int64_t block;
+        int wanted = (request->remaining > 0)
+                         ? mapRun(file, request->logicalBlock, request->remaining, MAX_IO_RUN, &block)
+                         : 0;
+        if (wanted == 0) {
+            unlockFile(request->inode);
+            completeIo(request, request->copied);
+            return;
+        }
+
+        if (block < 0) {
+            for (int i = 0; i < wanted && request->remaining > 0; i++) {
+                int length = (request->remaining < DATA_BLOCK_SIZE) ? request->remaining : DATA_BLOCK_SIZE;
+                const char *data = holeData(request->inode, request->logicalBlock + i);
+                if (data == NULL) {
+                    unlockFile(request->inode);
+                    completeIo(request, -11);
+                    return;
+                }
+                memcpy(request->buffer + request->copied, data, length);
+                request->copied += length;
+                request->remaining -= length;
+            }
+            request->logicalBlock += wanted;
+            continue;
+        }
+
+        for (int i = 0; i < wanted; i++) {
+            updateReadahead(request->inode, request->logicalBlock + i);
+        }
+        if (block >= COMPRESSED_KEY_BASE) {
+            // Compressed units are expanded here; there is nothing to wait for
+            request->pinned = getUnitBlocks(request->inode, block, wanted, request->frames);
+            if (request->pinned == 0) {
+                pushRequest(&ioEngine.deferred, request);
+                return;
+            }
+            continue;
+        }
+        request->pinned = pinBlocksDeferred(block, wanted, request->frames, request->inserted);
+        if (request->pinned == 0) {
+            pushRequest(&ioEngine.deferred, request);
+            return;
+        }
+
+        queueTransfers(request);
+        if (framesLoading(request)) {
+            pushRequest(&ioEngine.waiting, request);
+            return;
+        }
+    }
+}
+
+// Starts a request on the ring thread. File locks are only tried, since
+// blocking here would stall every request in flight.
+void startRingRequest(IoRequest *request) {
+    ParsedPath parsed;
+    if (parsePath(request->path, &parsed) != 0) {
+        completeIo(request, -1);
+        return;
+    }
+
+    int inode = lockFile(&parsed, request->opcode == IO_OP_WRITE, 0);
+    if (inode == -5) {
+        pushRequest(&ioEngine.deferred, request);
+        return;
+    }
+    if (inode < 0) {
+        completeIo(request, inode);
+        return;
+    }
+
+    if (request->opcode == IO_OP_WRITE) {
+        // Writes only touch the cache or the file's buffered blocks, so they
+        // finish right away. Only unpacking a small file leaves anything to
+        // journal.
+        beginTransaction();
+        int result = writeLocked(inode, request->buffer, request->length);
+        unlockFile(inode);
+        if (commitTransaction() != 0) {
+            result = -1;
+        }
+        completeIo(request, result);
+        return;
+    }
+
+    FileMetadata *file = &inodeTable.inodes[inode];
+    request->inode = inode;
+    request->logicalBlock = 0;
+    request->copied = 0;
+    request->remaining = (file->size < request->length) ? (int) file->size : request->length;
+    request->pinned = 0;
+    advanceRead(request);
+}
+
+// Retries everything deferred; requests that already hold their file lock
+// pick up where they stopped.
+void retryDeferred() {
+    IoRequest *deferred = ioEngine.deferred;
+    ioEngine.deferred = NULL;
+    while (deferred != NULL) {
+        IoRequest *request = deferred;
+        deferred = deferred->next;
+        if (request->inode >= 0) {
+            advanceRead(request);
+        } else {
+            startRingRequest(request);
+        }
+    }
+}
+
+// Resumes reads whose frames have all finished loading.
+void resumeWaiting() {
+    IoRequest *waiting = ioEngine.waiting;
+    ioEngine.waiting = NULL;
+    while (waiting != NULL) {
+        IoRequest *request = waiting;
+        waiting = waiting->next;
+        if (framesLoading(request)) {
+            pushRequest(&ioEngine.waiting, request);
+        } else {
+            advanceRead(request);
+        }
+    }
+}
+
+void *ioRingThread(void *arg) {
+    (void) arg;
+
+    armEventPoll();
+    while (1) {
+        pthread_mutex_lock(&ioEngine.lock);
+        IoRequest *submitted = ioEngine.submitted;
+        for (IoRequest *request = submitted; request != NULL; request = request->next) {
+            ioEngine.ringRequests++;
+        }
+        ioEngine.submitted = NULL;
+        ioEngine.submittedTail = NULL;
+        int stop = ioEngine.stop;
+        pthread_mutex_unlock(&ioEngine.lock);
+
+        while (submitted != NULL) {
+            IoRequest *request = submitted;
+            submitted = submitted->next;
+            startRingRequest(request);
+        }
+        retryDeferred();
+
+        if (stop && ioEngine.waiting == NULL && ioEngine.deferred == NULL) {
+            break;
+        }
+        // Frames a synchronous reader is loading land without a completion,
+        // so waiting reads are retried on the timeout like deferred ones
+        if ((ioEngine.deferred != NULL || ioEngine.waiting != NULL) && !ioEngine.timeoutArmed) {
+            struct io_uring_sqe *sqe = queueSqe(&ioEngine.ring, IO_TAG_TIMEOUT);
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = (uint64_t) (uintptr_t) &ioEngine.retryDelay;
+            sqe->len = 1;
+            ioEngine.timeoutArmed = 1;
+        }
+
+        enterRing(&ioEngine.ring, 1);
+
+        unsigned head = *ioEngine.ring.cqHead;
+        while (head != __atomic_load_n(ioEngine.ring.cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ioEngine.ring.cqes[head & ioEngine.ring.cqMask];
+            if (cqe->user_data == IO_TAG_EVENT) {
+                uint64_t count;
+                if (read(ioEngine.eventFd, &count, sizeof(count)) < 0) {
+                    count = 0;
+                }
+                armEventPoll();
+            } else if (cqe->user_data == IO_TAG_TIMEOUT) {
+                ioEngine.timeoutArmed = 0;
+            } else {
+                finishTransfer((IoTransfer *) (uintptr_t) cqe->user_data, cqe->res);
+            }
+            head++;
+            __atomic_store_n(ioEngine.ring.cqHead, head, __ATOMIC_RELEASE);
+        }
+
+        resumeWaiting();
+    }
+
+    return NULL;
+}
+
+void *ioWorkerThread(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&ioEngine.lock);
+    while (1) {
+        while (ioEngine.submitted == NULL && !ioEngine.stop) {
+            pthread_cond_wait(&ioEngine.available, &ioEngine.lock);
+        }
+        if (ioEngine.submitted == NULL) {
+            break;
+        }
+
+        IoRequest *request = ioEngine.submitted;
+        ioEngine.submitted = request->next;
+        if (ioEngine.submitted == NULL) {
+            ioEngine.submittedTail = NULL;
+        }
+        ioEngine.pooledRequests++;
+        pthread_mutex_unlock(&ioEngine.lock);
+
+        completeIo(request, executeIo(request));
+
+        pthread_mutex_lock(&ioEngine.lock);
+    }
+    pthread_mutex_unlock(&ioEngine.lock);
+
+    return NULL;
+}
+
+// Uses io_uring when the kernel allows it and a thread pool otherwise.
+int startIoEngine() {
+    memset(&ioEngine, 0, sizeof(ioEngine));
+    pthread_mutex_init(&ioEngine.lock, NULL);
+    pthread_cond_init(&ioEngine.available, NULL);
+    pthread_cond_init(&ioEngine.completion, NULL);
+    ioEngine.retryDelay.tv_nsec = IO_RETRY_DELAY_NS;
+
+    if (useIoUring) {
+        ioEngine.eventFd = eventfd(0, EFD_CLOEXEC);
+        if (ioEngine.eventFd >= 0 && setupRing(&ioEngine.ring, IO_RING_ENTRIES) == 0) {
+            ioEngine.useRing = 1;
+        } else if (ioEngine.eventFd >= 0) {
+            close(ioEngine.eventFd);
+        }
+    }
+
+    if (ioEngine.useRing) {
+        if (pthread_create(&ioEngine.workers[0], NULL, ioRingThread, NULL) != 0) {
+            teardownRing(&ioEngine.ring);
+            close(ioEngine.eventFd);
+            return -1;
+        }
+        ioEngine.workerCount = 1;
+    } else {
+        for (int i = 0; i < IO_WORKERS; i++) {
+            if (pthread_create(&ioEngine.workers[i], NULL, ioWorkerThread, NULL) != 0) {
+                break;
+            }
+            ioEngine.workerCount++;
+        }
+        if (ioEngine.workerCount == 0) {
+            return -1;
+        }
+    }
+
+    ioEngine.running = 1;
+    return 0;
+}
+
+// Finishes every submitted request, then stops the engine.
+void stopIoEngine() {
+    if (!ioEngine.running) {
+        return;
+    }
+
+    pthread_mutex_lock(&ioEngine.lock);
+    ioEngine.stop = 1;
+    pthread_cond_broadcast(&ioEngine.available);
+    pthread_mutex_unlock(&ioEngine.lock);
+    if (ioEngine.useRing) {
+        uint64_t one = 1;
+        if (write(ioEngine.eventFd, &one, sizeof(one)) < 0) {
+            printf("Error: Failed to wake the I/O engine.\n");
+        }
+    }
+
+    for (int i = 0; i < ioEngine.workerCount; i++) {
+        pthread_join(ioEngine.workers[i], NULL);
+    }
+    if (ioEngine.useRing) {
+        teardownRing(&ioEngine.ring);
+        close(ioEngine.eventFd);
+    }
+    ioEngine.running = 0;
+}
+
+// Queues request and returns at once. Returns -1 if the engine is not running.
+int submitIo(IoRequest *request) {
+    request->inode = -1;
+    request->pinned = 0;
+    request->next = NULL;
+
+    pthread_mutex_lock(&ioEngine.lock);
+    if (!ioEngine.running || ioEngine.stop) {
+        pthread_mutex_unlock(&ioEngine.lock);
+        return -1;
+    }
+    if (ioEngine.submittedTail != NULL) {
+        ioEngine.submittedTail->next = request;
+    } else {
+        ioEngine.submitted = request;
+    }
+    ioEngine.submittedTail = request;
+    if (request->callback == NULL) {
+        ioEngine.pendingCompletions++;
+    }
+    pthread_cond_signal(&ioEngine.available);
+    pthread_mutex_unlock(&ioEngine.lock);
+
+    if (ioEngine.useRing) {
+        uint64_t one = 1;
+        if (write(ioEngine.eventFd, &one, sizeof(one)) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Returns the next completed request that has no callback, waiting for one if
+// any is still in flight, or NULL if none is.
+IoRequest *waitForIo() {
+    pthread_mutex_lock(&ioEngine.lock);
+    while (ioEngine.completed == NULL && ioEngine.pendingCompletions > 0) {
+        pthread_cond_wait(&ioEngine.completion, &ioEngine.lock);
+    }
+
+    IoRequest *request = ioEngine.completed;
+    if (request != NULL) {
+        ioEngine.completed = request->next;
+        if (ioEngine.completed == NULL) {
+            ioEngine.completedTail = NULL;
+        }
+        ioEngine.pendingCompletions--;
+    }
+    pthread_mutex_unlock(&ioEngine.lock);
+    return request;
+}
+
+// Copies length bytes of buffer into the file at offset, stopping at the end
+// of the file. Returns how many bytes were written, or -4, -7 or -11 if not
+// even the first block could be written. The caller must hold the file's lock
+// exclusively and be inside a transaction.
+int writeAt(int inode, const char *buffer, int length, int64_t offset) {
+    FileMetadata *file = &inodeTable.inodes[inode];
+    if (offset >= file->size) {
+        return 0;
+    }
+    int unpacked = unpackFile(inode);
+    if (unpacked != 0) {
+        return unpacked;
+    }
+
+    int remaining = (length < file->size - offset) ? length : (int) (file->size - offset);
+    int written = 0;
+    int logicalBlock = offset / DATA_BLOCK_SIZE;
+    int skip = offset % DATA_BLOCK_SIZE;
+    while (remaining > 0) {
+        // Blocks only partly overwritten keep the rest of their contents
+        int result = writeRun(inode, logicalBlock, skip, buffer + written, remaining, 1);
+        if (result < 0) {
+            return (written > 0) ? written : result;
+        }
+        written += result;
+        remaining -= result;
+        logicalBlock += (skip + result + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+        skip = 0;
+    }
+    return written;
+}
+
+// Extends the file to size bytes. The new range stays a hole until it is
+// written, so this never allocates. Returns 0, or -7 or -11 as unpackFile
+// if a packed last block could not be moved out. The caller must hold the
+// file's lock exclusively and be inside a transaction.
+int growFile(int inode, int64_t size) {
+    FileMetadata *file = &inodeTable.inodes[inode];
+    if (size > file->size) {
+        // A packed last block stops being the last one
+        int unpacked = unpackFile(inode);
+        if (unpacked != 0) {
+            return unpacked;
+        }
+        file->size = size;
+        markDirty(file, sizeof(FileMetadata));
+    }
+    return 0;
+}
+
+// Checks up to SCRUB_BATCH_BLOCKS blocks of the file from its position-th
+// on, counting its extents' blocks in order, then its extent block, then its
+// packed tail. Returns how many it got through, which is 0 once past the
+// last, and how many failed in corrupt. The caller must hold the file's lock.
+int scrubFile(int inode, int position, int *corrupt) {
+    FileMetadata *file = &inodeTable.inodes[inode];
+    int blocks[SCRUB_BATCH_BLOCKS + 1];
+    int count = 0;
+    int extentBlocks = 0;
+    for (int i = 0; i < file->extentCount; i++) {
+        Extent *extent = fileExtent(file, i);
+        int from = (position > extentBlocks) ? position - extentBlocks : 0;
+        for (int j = from; j < extent->length && count < SCRUB_BATCH_BLOCKS; j++) {
+            blocks[count++] = extent->start + j;
+        }
+        extentBlocks += extent->length;
+    }
+    if (file->extentCount > MAX_EXTENTS && count < SCRUB_BATCH_BLOCKS && position + count == extentBlocks) {
+        blocks[count++] = file->extentBlock;
+    }
+    int tailPosition = extentBlocks + (file->extentCount > MAX_EXTENTS);
+    int checkTail = (file->flags & FILE_TAIL) && count < SCRUB_BATCH_BLOCKS && position + count == tailPosition;
+
+    // Write-backs copy into the mapping and seal under the cache lock
+    char intact[SCRUB_BATCH_BLOCKS + 1];
+    pthread_mutex_lock(&bufferCache.lock);
+    for (int i = 0; i < count; i++) {
+        intact[i] = blockIntact(blocks[i], dataBlocks[blocks[i]].data);
+    }
+    pthread_mutex_unlock(&bufferCache.lock);
+    if (checkTail) {
+        blocks[count] = file->tailBlock;
+        intact[count++] = tailIntact(file);
+    }
+
+    *corrupt = 0;
+    for (int i = 0; i < count; i++) {
+        if (!intact[i]) {
+            printf("Error: Block %d of file '%s' failed its checksum.\n", blocks[i], file->name);
+            (*corrupt)++;
+        }
+    }
+    __atomic_fetch_add(&scrubber.scrubbedBlocks, count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&scrubber.corruptBlocks, *corrupt, __ATOMIC_RELAXED);
+    return count;
+}
+
+// Checks the next batch of blocks from file *inode, block *position on,
+// skipping files with nothing left, and moves both past it. Returns how many
+// blocks failed, or -1 once every file has been checked.
+int scrubNext(int *inode, int *position) {
+    while (1) {
+        pthread_mutex_lock(&fileSystemLock);
+        int inodeCount = inodeTable.inodeCount;
+        pthread_mutex_unlock(&fileSystemLock);
+        if (*inode >= inodeCount) {
+            return -1;
+        }
+
+        FileMetadata *file = &inodeTable.inodes[*inode];
+        int checked = 0;
+        int corrupt = 0;
+        pthread_rwlock_rdlock(&inodeTable.states[*inode].lock);
+        if (file->inUse && file->type == FILE_TYPE_REGULAR) {
+            checked = scrubFile(*inode, *position, &corrupt);
+        }
+        pthread_rwlock_unlock(&inodeTable.states[*inode].lock);
+
+        if (checked > 0) {
+            *position += checked;
+            return corrupt;
+        }
+        (*inode)++;
+        *position = 0;
+    }
+}
+
+// Checks every block of every file now, on the calling thread. Returns how
+// many failed their checksum.
+int scrubVolume() {
+    int inode = 0;
+    int position = 0;
+    int corrupt = 0;
+    int found;
+    while ((found = scrubNext(&inode, &position)) >= 0) {
+        corrupt += found;
+    }
+    __atomic_fetch_add(&scrubber.passes, 1, __ATOMIC_RELAXED);
+    return corrupt;
+}
+
+// Works through the volume a batch at a time in the background, pausing
+// between batches so foreground I/O keeps the disk, and longer between passes.
+void *scrubThread(void *arg) {
+    (void) arg;
+
+    int interval = SCRUB_INTERVAL_MS;
+    pthread_mutex_lock(&scrubber.lock);
+    while (1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval / 1000;
+        deadline.tv_nsec += (interval % 1000) * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&scrubber.wake, &scrubber.lock, &deadline);
+        if (scrubber.stop) {
+            break;
+        }
+        pthread_mutex_unlock(&scrubber.lock);
+
+        interval = SCRUB_INTERVAL_MS;
+        if (scrubNext(&scrubber.nextInode, &scrubber.nextBlock) < 0) {
+            scrubber.nextInode = 0;
+            scrubber.nextBlock = 0;
+            __atomic_fetch_add(&scrubber.passes, 1, __ATOMIC_RELAXED);
+            interval = SCRUB_PASS_INTERVAL_MS;
+        }
+        pthread_mutex_lock(&scrubber.lock);
+    }
+    pthread_mutex_unlock(&scrubber.lock);
+
+    return NULL;
+}
+
+int startScrubber() {
+    scrubber.nextInode = 0;
+    scrubber.nextBlock = 0;
+    scrubber.stop = 0;
+    return pthread_create(&scrubber.worker, NULL, scrubThread, NULL) == 0 ? 0 : -1;
+}
+
+void stopScrubber() {
+    pthread_mutex_lock(&scrubber.lock);
+    scrubber.stop = 1;
+    pthread_cond_signal(&scrubber.wake);
+    pthread_mutex_unlock(&scrubber.lock);
+    pthread_join(scrubber.worker, NULL);
+}
+
+int startHandleTable() {
+    handleTable.handles = calloc(MAX_OPEN_FILES, sizeof(OpenFile));
+    handleTable.freeHandles = malloc(MAX_OPEN_FILES * sizeof(int));
+    if (handleTable.handles == NULL || handleTable.freeHandles == NULL) {
+        free(handleTable.handles);
+        free(handleTable.freeHandles);
+        return -1;
+    }
+
+    pthread_mutex_init(&handleTable.lock, NULL);
+    handleTable.freeCount = 0;
+    for (int i = MAX_OPEN_FILES - 1; i >= 0; i--) {
+        pthread_mutex_init(&handleTable.handles[i].lock, NULL);
+        handleTable.freeHandles[handleTable.freeCount++] = i;
+    }
+    return 0;
+}
+
+// Handles still open at unmount are dropped.
+void stopHandleTable() {
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        pthread_mutex_destroy(&handleTable.handles[i].lock);
+    }
+    pthread_mutex_destroy(&handleTable.lock);
+    free(handleTable.handles);
+    free(handleTable.freeHandles);
+}
+
+// Opens the file at path for mode, a mix of OPEN_READ and OPEN_WRITE.
+// Returns a handle, -1 if the file does not exist, -3 if it is a directory or
+// -9 if too many files are open.
+int openFile(char *path, int mode) {
+    ParsedPath parsed;
+    if (parsePath(path, &parsed) != 0) {
+        return -1;
+    }
+
+    int type;
+    uint32_t generation;
+    int inode = lookupPath(&parsed, &type, &generation);
+    if (inode < 0) {
+        return -1;
+    }
+    if (type != FILE_TYPE_REGULAR) {
+        return -3;
+    }
+    if ((mode & OPEN_WRITE) && (inodeTable.inodes[inode].flags & FILE_SNAPSHOT)) {
+        return -10;
+    }
+
+    pthread_mutex_lock(&handleTable.lock);
+    if (handleTable.freeCount == 0) {
+        pthread_mutex_unlock(&handleTable.lock);
+        return -9;
+    }
+    int handle = handleTable.freeHandles[--handleTable.freeCount];
+    OpenFile *file = &handleTable.handles[handle];
+    file->inode = inode;
+    file->generation = generation;
+    file->mode = mode;
+    file->position = 0;
+    file->inUse = 1;
+    pthread_mutex_unlock(&handleTable.lock);
+    return handle;
+}
+
+int closeFile(int handle) {
+    if (handle < 0 || handle >= MAX_OPEN_FILES) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&handleTable.lock);
+    if (!handleTable.handles[handle].inUse) {
+        pthread_mutex_unlock(&handleTable.lock);
+        return -1;
+    }
+    handleTable.handles[handle].inUse = 0;
+    handleTable.freeHandles[handleTable.freeCount++] = handle;
+    pthread_mutex_unlock(&handleTable.lock);
+    return 0;
+}
+
+// Takes the lock of the file behind handle. Returns the inode, -1 if the
+// handle is not open or its file was deleted, or -10 if the handle was not
+// opened for this kind of access.
+int lockHandle(int handle, int exclusive) {
+    if (handle < 0 || handle >= MAX_OPEN_FILES || !handleTable.handles[handle].inUse) {
+        return -1;
+    }
+
+    OpenFile *openFile = &handleTable.handles[handle];
+    if (!(openFile->mode & (exclusive ? OPEN_WRITE : OPEN_READ))) {
+        return -10;
+    }
+
+    int inode = openFile->inode;
+    if (exclusive) {
+        pthread_rwlock_wrlock(&inodeTable.states[inode].lock);
+    } else {
+        pthread_rwlock_rdlock(&inodeTable.states[inode].lock);
+    }
+
+    FileMetadata *file = &inodeTable.inodes[inode];
+    if (!file->inUse || file->generation != openFile->generation) {
+        unlockFile(inode);
+        return -1;
+    }
+    return inode;
+}
+
+// Reads up to length bytes at offset without moving the handle's position.
+// Returns how many bytes were read, which is 0 at the end of the file.
+int preadHandle(int handle, char *buffer, int length, int64_t offset) {
+    int inode = lockHandle(handle, 0);
+    if (inode < 0) {
+        return inode;
+    }
+
+    int result = readLocked(inode, buffer, length, offset);
+    unlockFile(inode);
+    return result;
+}
+
+// Reads from the handle's position and moves it past what was read.
+int readHandle(int handle, char *buffer, int length) {
+    if (handle < 0 || handle >= MAX_OPEN_FILES) {
+        return -1;
+    }
+
+    OpenFile *openFile = &handleTable.handles[handle];
+    pthread_mutex_lock(&openFile->lock);
+    int result = preadHandle(handle, buffer, length, openFile->position);
+    if (result > 0) {
+        openFile->position += result;
+    }
+    pthread_mutex_unlock(&openFile->lock);
+    return result;
+}
+
+// Writes length bytes at *offset, or at the end of the file if append is set,
+// growing the file as needed; *offset is left where the data went. Returns
+// how many bytes were written, -4 if the cache is full, -7 if the file could
+// not grow or -11 if a block failed its checksum.
+int writeHandle(int handle, const char *buffer, int length, int64_t *offset, int append) {
+    beginTransaction();
+    int inode = lockHandle(handle, 1);
+    if (inode < 0) {
+        commitTransaction();
+        return inode;
+    }
+
+    if (append) {
+        *offset = inodeTable.inodes[inode].size;
+    }
+    int result = -7;
+    if (*offset >= 0 && length >= 0 && *offset <= MAX_FILE_SIZE - length) {
+        FileMetadata *file = &inodeTable.inodes[inode];
+        int64_t oldSize = file->size;
+        result = growFile(inode, *offset + length);
+        if (result == 0) {
+            result = writeAt(inode, buffer, length, *offset);
+        }
+
+        // A write cut short by full space only grows the file as far as it got
+        int64_t reached = *offset + ((result > 0) ? result : 0);
+        if (result < length && file->size > oldSize) {
+            file->size = (reached > oldSize) ? reached : oldSize;
+            markDirty(file, sizeof(FileMetadata));
+        }
+    }
+    unlockFile(inode);
+
+    if (commitTransaction() != 0) {
+        return -1;
+    }
+    return result;
+}
+
+// Writes at offset without moving the handle's position.
+int pwriteHandle(int handle, const char *buffer, int length, int64_t offset) {
+    return writeHandle(handle, buffer, length, &offset, 0);
+}
+
+// Writes at the end of the file and leaves the handle's position after it.
+int appendHandle(int handle, const char *buffer, int length) {
+    if (handle < 0 || handle >= MAX_OPEN_FILES) {
+        return -1;
+    }
+
+    OpenFile *openFile = &handleTable.handles[handle];
+    pthread_mutex_lock(&openFile->lock);
+    int64_t offset;
+    int result = writeHandle(handle, buffer, length, &offset, 1);
+    if (result >= 0) {
+        openFile->position = offset + result;
+    }
+    pthread_mutex_unlock(&openFile->lock);
+    return result;
+}
+
+// Reserves zeroed blocks for every hole between offset and offset + length
+// so later writes there cannot run out of space, growing the file if the
+// range passes its end. Returns 0, -10 if the handle is read-only, -11 if
+// the packed last block failed its checksum or -7 if the space ran out, in
+// which case whatever was reserved stays.
+int fallocateHandle(int handle, int64_t offset, int64_t length) {
+    if (offset < 0 || length <= 0 || offset > MAX_FILE_SIZE - length) {
+        return -7;
+    }
+
+    beginTransaction();
+    int inode = lockHandle(handle, 1);
+    if (inode < 0) {
+        commitTransaction();
+        return inode;
+    }
+
+    // Buffered blocks are placed first, since holes they sit in get zeroed.
+    // A packed last block is given a block of its own like the rest.
+    FileMetadata *file = &inodeTable.inodes[inode];
+    int logicalBlock = (int) (offset / DATA_BLOCK_SIZE);
+    int endBlock = (int) ((offset + length + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE);
+    int result = unpackFile(inode);
+    if (result == 0) {
+        result = flushDelayed(inode, 0);
+    }
+    while (result == 0 && logicalBlock < endBlock) {
+        int run;
+        if (mapLogicalBlock(file, logicalBlock, &run) >= 0) {
+            logicalBlock += run;
+            continue;
+        }
+
+        int wanted = (run < endBlock - logicalBlock) ? run : endBlock - logicalBlock;
+        int filled = fillHole(file, logicalBlock, wanted);
+        if (filled < 0) {
+            result = filled;
+            break;
+        }
+        int block = mapLogicalBlock(file, logicalBlock, &run);
+        memset(&dataBlocks[block], 0, filled * sizeof(DataBlock));
+        markDirty(&dataBlocks[block], filled * sizeof(DataBlock));
+        logicalBlock += filled;
+    }
+    if (result == 0) {
+        result = growFile(inode, offset + length);
+    }
+    unlockFile(inode);
+
+    if (commitTransaction() != 0) {
+        return -1;
+    }
+    return result;
+}
+
+// Turns compression of the file's data on or off. Only data placed from now
+// on follows the setting; compressed units stay so until they are rewritten.
+// Returns 0, -1 if the file does not exist or the journal could not be
+// written, or -3 if it is a directory.
+int setFileCompression(char *path, int enabled) {
+    ParsedPath parsed;
+    if (parsePath(path, &parsed) != 0) {
+        return -1;
+    }
+
+    beginTransaction();
+    int inode = lockFile(&parsed, 1, 1);
+    if (inode < 0) {
+        commitTransaction();
+        return inode;
+    }
+    FileMetadata *file = &inodeTable.inodes[inode];
+    file->flags = enabled ? (file->flags | FILE_COMPRESSED) : (file->flags & ~FILE_COMPRESSED);
+    markDirty(file, sizeof(FileMetadata));
+    unlockFile(inode);
+
+    return commitTransaction();
+}
+
+// Fills report for the file at path. Buffered blocks are not counted until
+// they are placed. Returns 0, -1 if the file does not exist or -3 if it is a
+// directory.
+int compressionReport(char *path, CompressionReport *report) {
+    ParsedPath parsed;
+    if (parsePath(path, &parsed) != 0) {
+        return -1;
+    }
+
+    int inode = lockFile(&parsed, 0, 1);
+    if (inode < 0) {
+        return inode;
+    }
+    FileMetadata *file = &inodeTable.inodes[inode];
+    memset(report, 0, sizeof(CompressionReport));
+    report->compressed = (file->flags & FILE_COMPRESSED) != 0;
+    for (int i = 0; i < file->extentCount; i++) {
+        Extent *extent = fileExtent(file, i);
+        if (extent->flags & EXTENT_COMPRESSED) {
+            UnitHeader header;
+            memcpy(&header, dataBlocks[extent->start].data, sizeof(header));
+            report->unitCount++;
+            report->expandedBlocks += (header.expandedLength + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+            report->storedBlocks += extent->length;
+        }
+    }
+    report->compressNs = __atomic_load_n(&inodeTable.states[inode].compressNs, __ATOMIC_RELAXED);
+    report->expandNs = __atomic_load_n(&inodeTable.states[inode].expandNs, __ATOMIC_RELAXED);
+    unlockFile(inode);
+    return 0;
+}
 
-Directory rootDirectory;
-DataBlock dataBlocks[MAX_DATA_BLOCKS];
-FAT fileAllocationTable;
+// Frees what the retired inode held and then its slot. Called inside a
+// transaction, without fileSystemLock.
+void reclaimInode(int inode) {
+    FileMetadata *file = &inodeTable.inodes[inode];
 
-pthread_mutex_t fileSystemLock = PTHREAD_MUTEX_INITIALIZER;
+    // Wait for readers and writers still inside the file to leave
+    Extent extents[MAX_FILE_EXTENTS + 1];
+    int extentCount = 0;
+    if (file->type == FILE_TYPE_REGULAR) {
+        pthread_rwlock_wrlock(&inodeTable.states[inode].lock);
+        for (; extentCount < file->extentCount; extentCount++) {
+            extents[extentCount] = *fileExtent(file, extentCount);
+        }
+        if (file->extentCount > MAX_EXTENTS) {
+            extents[extentCount++] = (Extent) {.start = file->extentBlock, .length = 1};
+        }
+        dropDelayed(inode, 0, inodeTable.states[inode].delayedCount, 0);
+        if (file->flags & FILE_TAIL) {
+            releaseTail(file->tailBlock, file->tailOffset, lastBlockLength(file));
+        }
+        pthread_rwlock_unlock(&inodeTable.states[inode].lock);
+    }
+    releaseExtents(extents, extentCount);
 
-void initializeFileSystem() {
-    rootDirectory.fileCount = 0;
-    memset(fileAllocationTable.allocationTable, -1, sizeof(fileAllocationTable.allocationTable));
+    // Only now may the slot be reused
+    pthread_mutex_lock(&fileSystemLock);
+    inodeTable.freeInodes[inodeTable.freeInodeCount++] = inode;
+    pthread_mutex_unlock(&fileSystemLock);
 }
 
-int createFile(char *name, int size, int permissions) {
-    if (rootDirectory.fileCount >= MAX_FILES) {
-        printf("Error: Maximum number of files reached.\n");
+// Unlinks the entry at path, which must have the given type. Directories
+// must be empty.
+int unlinkPath(char *path, int type) {
+    ParsedPath parsed;
+    if (parsePath(path, &parsed) != 0) {
+        printf("Error: File '%s' not found.\n", path);
         return -1;
     }
 
-    if (strlen(name) > MAX_FILENAME_LENGTH) {
-        printf("Error: File name is too long.\n");
-        return -2;
+    beginTransaction();
+    pthread_mutex_lock(&fileSystemLock);
+
+    char name[MAX_FILENAME_LENGTH];
+    int parent = resolveParent(&parsed, name);
+    int inode = (parent < 0) ? -1 : searchDirectory(parent, name);
+    if (inode == -1) {
+        printf("Error: File '%s' not found.\n", path);
+        pthread_mutex_unlock(&fileSystemLock);
+        commitTransaction();
+        return -1;
     }
 
-    if (size <= 0 || size > MAX_DATA_BLOCKS * DATA_BLOCK_SIZE) {
-        printf("Error: Invalid file size.\n");
+    FileMetadata *file = &inodeTable.inodes[inode];
+    if (file->type != type) {
+        printf("Error: '%s' is %s.\n", path, (file->type == FILE_TYPE_DIRECTORY) ? "a directory" : "not a directory");
+        pthread_mutex_unlock(&fileSystemLock);
+        commitTransaction();
         return -3;
     }
 
-    FileMetadata file;
-    strcpy(file.name, name);
-    file.size = size;
-    file.permissions = permissions;
+    if (file->flags & FILE_SNAPSHOT) {
+        printf("Error: '%s' is in a snapshot.\n", path);
+        pthread_mutex_unlock(&fileSystemLock);
+        commitTransaction();
+        return -10;
+    }
 
-    int allocatedBlocks = 0;
-    int currentBlock = 0;
-    while (allocatedBlocks < size / DATA_BLOCK_SIZE && currentBlock < MAX_DATA_BLOCKS) {
-        if (fileAllocationTable.allocationTable[currentBlock] == -1) {
-            fileAllocationTable.allocationTable[currentBlock] = file.firstDataBlock + allocatedBlocks;
-            allocatedBlocks++;
+    if (type == FILE_TYPE_DIRECTORY) {
+        if (file->entryCount > 0) {
+            printf("Error: Directory '%s' is not empty.\n", path);
+            pthread_mutex_unlock(&fileSystemLock);
+            commitTransaction();
+            return -8;
         }
-        currentBlock++;
     }
 
-    if (allocatedBlocks < size / DATA_BLOCK_SIZE) {
-        printf("Error: Not enough free data blocks available.\n");
-        return -4;
-    }
+    // Retire the inode before freeing its blocks so readahead and threads
+    // that already resolved it stop using them
+    beginNamespaceWrite();
+    removeEntry(parent, name);
+    retireInode(inode);
+    endNamespaceWrite();
 
-    FILE *filePtr = fopen(name, "wb");
-    if (filePtr == NULL) {
-        printf("Error: Failed to create file '%s'.\n", name);
-        return -5;
-    }
+    pthread_mutex_unlock(&fileSystemLock);
 
-    int blockIndex = file.firstDataBlock;
-    while (size > 0 && blockIndex != -1) {
-        DataBlock *dataBlock = &dataBlocks[blockIndex];
-        fwrite(dataBlock->data, sizeof(char), DATA_BLOCK_SIZE, filePtr);
-        size -= DATA_BLOCK_SIZE;
-        blockIndex = fileAllocationTable.allocationTable[blockIndex];
+    reclaimInode(inode);
+
+    if (commitTransaction() != 0) {
+        return -1;
     }
 
-    fclose(filePtr);
+    printf("%s '%s' deleted successfully.\n", (type == FILE_TYPE_DIRECTORY) ? "Directory" : "File", path);
+    return 0;
+}
 
-    pthread_mutex_lock(&fileSystemLock);
+int deleteFile(char *path) {
+    return unlinkPath(path, FILE_TYPE_REGULAR);
+}
 
-    rootDirectory.files[rootDirectory.fileCount] = file;
-    rootDirectory.fileCount++;
+int deleteDirectory(char *path) {
+    return unlinkPath(path, FILE_TYPE_DIRECTORY);
+}
 
-    pthread_mutex_unlock(&fileSystemLock);
+// Gives clone, a new file nobody else can reach yet, the contents of source,
+// which has no buffered blocks. The extents are shared, each block gaining a
+// reference, and only the inline data and packed tail are copied. Returns 0,
+// -7 if the space for an extent block or the tail ran out or -11 if the tail
+// failed its checksum; clone then keeps what it got so far. The caller must
+// hold source's lock exclusively and be inside a transaction.
+int cloneContents(int source, int clone) {
+    FileMetadata *from = &inodeTable.inodes[source];
+    FileMetadata *to = &inodeTable.inodes[clone];
+    to->size = from->size;
+    to->flags = from->flags & (FILE_INLINE | FILE_COMPRESSED);
+    if (from->flags & FILE_INLINE) {
+        memcpy(to->inlineData, from->inlineData, INLINE_DATA_SIZE);
+    }
+    markDirty(to, sizeof(FileMetadata));
+
+    for (int i = 0; i < from->extentCount; i++) {
+        Extent extent = *fileExtent(from, i);
+        pthread_mutex_lock(&blockRefs.lock);
+        addReferences(extent.start, extent.length);
+        pthread_mutex_unlock(&blockRefs.lock);
+        if (insertExtent(to, extent) != 0) {
+            releaseExtents(&extent, 1);
+            return -7;
+        }
+        __atomic_fetch_add(&cloneStats.sharedBlocks, extent.length, __ATOMIC_RELAXED);
+    }
 
-    printf("File '%s' created successfully.\n", name);
+    // Tails share their block with other files' tails, so each file gets its own
+    if (from->flags & FILE_TAIL) {
+        int length = lastBlockLength(from);
+        if (!tailIntact(from)) {
+            return -11;
+        }
+        if (allocateTail(length, &to->tailBlock, &to->tailOffset) != 0) {
+            return -7;
+        }
+        char *tail = dataBlocks[to->tailBlock].data + to->tailOffset;
+        pthread_mutex_lock(&tailStore.lock);
+        memcpy(tail, dataBlocks[from->tailBlock].data + from->tailOffset, length);
+        markDirty(tail, length);
+        pthread_mutex_unlock(&tailStore.lock);
+        to->flags |= FILE_TAIL;
+        markDirty(to, sizeof(FileMetadata));
+    }
     return 0;
 }
 
-void listFiles() {
-    pthread_mutex_lock(&fileSystemLock);
-
-    printf("Files in the root directory:\n");
-    for (int i = 0; i < rootDirectory.fileCount; i++) {
-        printf("- %s (Size: %d bytes, Permissions: %d)\n", rootDirectory.files[i].name,
-               rootDirectory.files[i].size, rootDirectory.files[i].permissions);
+// Takes the locks of count files exclusively without waiting. Returns -1
+// once all are held, or else the index of the first one in use, having given
+// back those already taken.
+int tryLockFiles(const int *inodes, int count) {
+    for (int i = 0; i < count; i++) {
+        if (pthread_rwlock_trywrlock(&inodeTable.states[inodes[i]].lock) != 0) {
+            for (int j = 0; j < i; j++) {
+                unlockFile(inodes[j]);
+            }
+            return i;
+        }
     }
+    return -1;
+}
 
+// Lets go of fileSystemLock until the file's lock is free. A thread holding
+// a file lock may be waiting for fileSystemLock, so it is never waited for
+// with the namespace held.
+void waitForFile(int inode) {
     pthread_mutex_unlock(&fileSystemLock);
+    pthread_rwlock_wrlock(&inodeTable.states[inode].lock);
+    pthread_rwlock_unlock(&inodeTable.states[inode].lock);
+    __atomic_fetch_add(&cloneStats.busyWaits, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&fileSystemLock);
 }
 
-int readFile(char *name) {
-    pthread_mutex_lock(&fileSystemLock);
+// Appends the inodes of the tree under node to inodes, each directory after
+// its entries, leaving out the directory skip. Called with fileSystemLock
+// held.
+void collectTree(BTreeNode *node, int skip, int *inodes, int *count) {
+    if (node == NULL) {
+        return;
+    }
 
-    int errorCode = 0;
-    int fileIndex = -1;
-    for (int i = 0; i < rootDirectory.fileCount; i++) {
-        if (strcmp(rootDirectory.files[i].name, name) == 0) {
-            fileIndex = i;
+    for (int i = 0; i <= node->keyCount; i++) {
+        if (!node->leaf) {
+            collectTree(node->children[i], skip, inodes, count);
+        }
+        if (i == node->keyCount) {
             break;
         }
+        int inode = node->keys[i];
+        if (inode == skip) {
+            continue;
+        }
+        if (inodeTable.inodes[inode].type == FILE_TYPE_DIRECTORY) {
+            collectTree(inodeTable.entries[inode], skip, inodes, count);
+        }
+        inodes[(*count)++] = inode;
     }
+}
 
-    if (fileIndex == -1) {
-        printf("Error: File '%s' not found.\n", name);
-        errorCode = -1;
-    } else {
-        FileMetadata *file = &rootDirectory.files[fileIndex];
+// Recreates the tree under node as read-only entries of target, cloning the
+// files, whose locks the caller holds. Returns 0, -1 if the inodes ran out
+// or an error of cloneContents; what was made stays for the caller to
+// remove. Called with fileSystemLock held, in a namespace write and a
+// transaction.
+int cloneTree(BTreeNode *node, int target, int skip) {
+    if (node == NULL) {
+        return 0;
+    }
 
-        FILE *filePtr = fopen(name, "rb");
-        if (filePtr == NULL) {
-            printf("Error: Failed to open file '%s' for reading.\n", name);
-            errorCode = -2;
-        } else {
-            int blockIndex = file->firstDataBlock;
-            while (file->size > 0 && blockIndex != -1) {
-                DataBlock *dataBlock = &dataBlocks[blockIndex];
-                printf("%s", dataBlock->data);
-                file->size -= DATA_BLOCK_SIZE;
-                blockIndex = fileAllocationTable.allocationTable[blockIndex];
+    for (int i = 0; i <= node->keyCount; i++) {
+        if (!node->leaf) {
+            int result = cloneTree(node->children[i], target, skip);
+            if (result != 0) {
+                return result;
             }
+        }
+        if (i == node->keyCount) {
+            break;
+        }
+        int inode = node->keys[i];
+        if (inode == skip) {
+            continue;
+        }
+
+        FileMetadata *file = &inodeTable.inodes[inode];
+        int copy = linkNewInode(target, file->name, file->type, file->permissions);
+        if (copy == -1) {
+            return -1;
+        }
+        int result = (file->type == FILE_TYPE_DIRECTORY) ? cloneTree(inodeTable.entries[inode], copy, skip)
+                                                         : cloneContents(inode, copy);
+        inodeTable.inodes[copy].flags |= FILE_SNAPSHOT;
+        markDirty(&inodeTable.inodes[copy], sizeof(FileMetadata));
+        if (result != 0) {
+            return result;
+        }
+        __atomic_fetch_add(&cloneStats.clonedFiles, file->type == FILE_TYPE_REGULAR, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+// Unlinks and retires directory and everything under it, leaving their
+// inodes in inodes for reclaimInode. Returns how many there are. Called with
+// fileSystemLock held, in a namespace write.
+int detachTree(int directory, int *inodes) {
+    int count = 0;
+    collectTree(inodeTable.entries[directory], -1, inodes, &count);
+    inodes[count++] = directory;
+    for (int i = 0; i < count; i++) {
+        FileMetadata *file = &inodeTable.inodes[inodes[i]];
+        removeEntry(file->parent, file->name);
+        retireInode(inodes[i]);
+    }
+    return count;
+}
+
+// Makes target a file with the contents of source that shares all of its
+// blocks, so the clone costs only metadata however large the file is. A file
+// copies a shared block before changing it. source may be in a snapshot,
+// which restores it from there. Returns 0, -1 if source does not exist or
+// the inodes or journal failed, -2 if a name is too long, -3 if source is a
+// directory, -6 if target exists, -7 if its parent is missing or space ran
+// out, -10 if target would be in a snapshot or -11 if source is corrupt.
+int cloneFile(char *source, char *target) {
+    ParsedPath sourcePath;
+    ParsedPath targetPath;
+    if (parsePath(source, &sourcePath) != 0 || parsePath(target, &targetPath) != 0) {
+        printf("Error: File name is too long.\n");
+        return -2;
+    }
+
+    beginTransaction();
+    pthread_mutex_lock(&fileSystemLock);
 
-            fclose(filePtr);
+    char name[MAX_FILENAME_LENGTH];
+    int inode;
+    int parent;
+    int result = 0;
+    while (1) {
+        inode = resolvePath(&sourcePath);
+        parent = resolveParent(&targetPath, name);
+        if (inode < 0) {
+            result = -1;
+        } else if (inodeTable.inodes[inode].type != FILE_TYPE_REGULAR) {
+            result = -3;
+        } else if (parent < 0) {
+            result = -7;
+        } else if (inodeTable.inodes[parent].flags & FILE_SNAPSHOT) {
+            result = -10;
+        } else if (searchDirectory(parent, name) != -1) {
+            result = -6;
+        }
+        if (result != 0 || tryLockFiles(&inode, 1) == -1) {
+            break;
         }
+        waitForFile(inode);
     }
 
+    int failed = -1;
+    if (result == 0) {
+        result = flushDelayed(inode, 1);
+        beginNamespaceWrite();
+        int clone = -1;
+        if (result == 0) {
+            clone = linkNewInode(parent, name, FILE_TYPE_REGULAR, inodeTable.inodes[inode].permissions);
+            result = (clone == -1) ? -1 : 0;
+        }
+        if (clone != -1) {
+            result = cloneContents(inode, clone);
+            if (result != 0) {
+                removeEntry(parent, name);
+                retireInode(clone);
+                failed = clone;
+            }
+        }
+        endNamespaceWrite();
+        unlockFile(inode);
+    }
     pthread_mutex_unlock(&fileSystemLock);
 
-    return errorCode;
+    if (failed != -1) {
+        reclaimInode(failed);
+    }
+    if (commitTransaction() != 0 && result == 0) {
+        result = -1;
+    }
+
+    if (result == 0) {
+        __atomic_fetch_add(&cloneStats.clonedFiles, 1, __ATOMIC_RELAXED);
+        printf("File '%s' cloned to '%s'.\n", source, target);
+    } else if (result == -1) {
+        printf("Error: Failed to clone '%s'.\n", source);
+    } else if (result == -3) {
+        printf("Error: '%s' is a directory.\n", source);
+    } else if (result == -6) {
+        printf("Error: File '%s' already exists.\n", target);
+    } else if (result == -7) {
+        printf("Error: No room to clone '%s' to '%s'.\n", source, target);
+    } else if (result == -10) {
+        printf("Error: '%s' is inside a snapshot.\n", target);
+    } else if (result == -11) {
+        printf("Error: File '%s' is corrupt.\n", source);
+    }
+    return result;
 }
 
-int writeFile(char *name, char *content) {
+// Takes a read-only snapshot of every file and directory as
+// /SNAPSHOT_DIRECTORY/name. Files in use are waited for, then all are held
+// at once so the snapshot is one point in time. Its files share their blocks
+// with the live ones and have locks of their own, so it costs only metadata
+// and reading it never holds up writers. Returns 0, -1 if the inodes or the
+// journal failed, -2 if the name is invalid, -4 if memory ran out, -6 if the
+// snapshot exists, -7 if space ran out or -11 if a packed tail is corrupt.
+int createSnapshot(char *name) {
+    if (name[0] == '\0' || strchr(name, '/') != NULL || strlen(name) >= MAX_FILENAME_LENGTH) {
+        printf("Error: Invalid snapshot name '%s'.\n", name);
+        return -2;
+    }
+
+    beginTransaction();
     pthread_mutex_lock(&fileSystemLock);
 
-    int errorCode = 0;
-    int fileIndex = -1;
-    for (int i = 0; i < rootDirectory.fileCount; i++) {
-        if (strcmp(rootDirectory.files[i].name, name) == 0) {
-            fileIndex = i;
+    // The second half takes the snapshot's own inodes should it fail
+    int *inodes = NULL;
+    int fileCount = 0;
+    while (1) {
+        free(inodes);
+        inodes = malloc((2 * inodeTable.inodeCount + 2) * sizeof(int));
+        if (inodes == NULL) {
+            pthread_mutex_unlock(&fileSystemLock);
+            commitTransaction();
+            printf("Error: Out of memory.\n");
+            return -4;
+        }
+
+        int count = 0;
+        collectTree(inodeTable.entries[ROOT_INODE], searchDirectory(ROOT_INODE, SNAPSHOT_DIRECTORY), inodes, &count);
+        fileCount = 0;
+        for (int i = 0; i < count; i++) {
+            if (inodeTable.inodes[inodes[i]].type == FILE_TYPE_REGULAR) {
+                inodes[fileCount++] = inodes[i];
+            }
+        }
+        int busy = tryLockFiles(inodes, fileCount);
+        if (busy == -1) {
             break;
         }
+        waitForFile(inodes[busy]);
     }
 
-    if (fileIndex == -1) {
-        printf("Error: File '%s' not found.\n", name);
-        errorCode = -1;
-    } else {
-        FileMetadata *file = &rootDirectory.files[fileIndex];
+    int result = 0;
+    for (int i = 0; i < fileCount && result == 0; i++) {
+        result = flushDelayed(inodes[i], 1);
+    }
 
-        FILE *filePtr = fopen(name, "wb");
-        if (filePtr == NULL) {
-            printf("Error: Failed to open file '%s' for writing.\n", name);
-            errorCode = -2;
+    beginNamespaceWrite();
+    int root = searchDirectory(ROOT_INODE, SNAPSHOT_DIRECTORY);
+    if (result == 0 && root == -1) {
+        root = linkNewInode(ROOT_INODE, SNAPSHOT_DIRECTORY, FILE_TYPE_DIRECTORY, 755);
+        if (root == -1) {
+            result = -1;
         } else {
-            int contentLength = strlen(content);
-            int blockSize = DATA_BLOCK_SIZE;
-            int blockCount = 0;
-            int blockIndex = file->firstDataBlock;
-            while (blockCount < file->size / blockSize && blockIndex != -1 && contentLength > 0) {
-                DataBlock *dataBlock = &dataBlocks[blockIndex];
-                strncpy(dataBlock->data, content, blockSize);
-                fwrite(dataBlock->data, sizeof(char), blockSize, filePtr);
-                content += blockSize;
-                contentLength -= blockSize;
-                blockCount++;
-                blockIndex = fileAllocationTable.allocationTable[blockIndex];
-            }
-
-            fclose(filePtr);
+            inodeTable.inodes[root].flags |= FILE_SNAPSHOT;
+            markDirty(&inodeTable.inodes[root], sizeof(FileMetadata));
+        }
+    }
+    if (result == 0 && searchDirectory(root, name) != -1) {
+        result = -6;
+    }
+    int snapshot = -1;
+    if (result == 0) {
+        snapshot = linkNewInode(root, name, FILE_TYPE_DIRECTORY, 755);
+        if (snapshot == -1) {
+            result = -1;
+        } else {
+            inodeTable.inodes[snapshot].flags |= FILE_SNAPSHOT;
+            markDirty(&inodeTable.inodes[snapshot], sizeof(FileMetadata));
+            result = cloneTree(inodeTable.entries[ROOT_INODE], snapshot, root);
         }
     }
+    int detached = (result != 0 && snapshot != -1) ? detachTree(snapshot, inodes + fileCount) : 0;
+    endNamespaceWrite();
 
+    for (int i = 0; i < fileCount; i++) {
+        unlockFile(inodes[i]);
+    }
     pthread_mutex_unlock(&fileSystemLock);
 
-    return errorCode;
+    for (int i = 0; i < detached; i++) {
+        reclaimInode(inodes[fileCount + i]);
+    }
+    free(inodes);
+    if (commitTransaction() != 0 && result == 0) {
+        result = -1;
+    }
+
+    if (result == 0) {
+        __atomic_fetch_add(&cloneStats.snapshots, 1, __ATOMIC_RELAXED);
+        printf("Snapshot '%s' created successfully.\n", name);
+    } else if (result == -6) {
+        printf("Error: Snapshot '%s' already exists.\n", name);
+    } else if (result == -7) {
+        printf("Error: No room for snapshot '%s'.\n", name);
+    } else if (result == -11) {
+        printf("Error: Snapshot '%s' found a corrupt file.\n", name);
+    } else {
+        printf("Error: Failed to create snapshot '%s'.\n", name);
+    }
+    return result;
+}
+
+// Deletes the snapshot and everything in it. Blocks still shared with other
+// files only lose a reference. Returns 0, -1 if there is no such snapshot or
+// the journal could not be written, or -4 if memory ran out.
+int deleteSnapshot(char *name) {
+    beginTransaction();
+    pthread_mutex_lock(&fileSystemLock);
+
+    int root = searchDirectory(ROOT_INODE, SNAPSHOT_DIRECTORY);
+    int snapshot = (root == -1) ? -1 : searchDirectory(root, name);
+    if (snapshot == -1) {
+        printf("Error: Snapshot '%s' not found.\n", name);
+        pthread_mutex_unlock(&fileSystemLock);
+        commitTransaction();
+        return -1;
+    }
+    int *inodes = malloc(inodeTable.inodeCount * sizeof(int));
+    if (inodes == NULL) {
+        printf("Error: Out of memory.\n");
+        pthread_mutex_unlock(&fileSystemLock);
+        commitTransaction();
+        return -4;
+    }
+
+    beginNamespaceWrite();
+    int count = detachTree(snapshot, inodes);
+    endNamespaceWrite();
+    pthread_mutex_unlock(&fileSystemLock);
+
+    for (int i = 0; i < count; i++) {
+        reclaimInode(inodes[i]);
+    }
+    free(inodes);
+
+    if (commitTransaction() != 0) {
+        return -1;
+    }
+    printf("Snapshot '%s' deleted successfully.\n", name);
+    return 0;
 }
 
 void *concurrentFileAccess(void *arg) {
@@ -220,8 +7025,349 @@ void *concurrentFileAccess(void *arg) {
     return NULL;
 }
 
-int main() {
-    initializeFileSystem();
+#define COMMIT_CHECK_THREADS 8
+#define COMMIT_CHECK_APPENDS 32
+#define COMMIT_CHECK_LINE "commit check line\n"
+
+// Appends lines to a log of its own, each append a transaction of its own,
+// so that several threads are waiting on the journal at once.
+void *concurrentCommits(void *arg) {
+    int threadId = *((int *) arg);
+    char fileName[32];
+    sprintf(fileName, "/commits/log_%d", threadId);
+    int handle = openFile(fileName, OPEN_WRITE);
+    if (handle < 0) {
+        return NULL;
+    }
+    for (int i = 0; i < COMMIT_CHECK_APPENDS; i++) {
+        appendHandle(handle, COMMIT_CHECK_LINE, strlen(COMMIT_CHECK_LINE));
+    }
+    closeFile(handle);
+    return NULL;
+}
+
+// Runs COMMIT_CHECK_THREADS appending threads and checks that every line
+// landed and that the journal wrote some transactions out together. Returns
+// 0, or -1 if a log is short or every transaction took a write of its own.
+int checkGroupCommit() {
+    // Each log starts one byte long, the smallest size createFile takes
+    int expected = 1 + COMMIT_CHECK_APPENDS * strlen(COMMIT_CHECK_LINE);
+    char fileName[32];
+    createDirectory("/commits", 755);
+    for (int i = 0; i < COMMIT_CHECK_THREADS; i++) {
+        sprintf(fileName, "/commits/log_%d", i);
+        createFile(fileName, 1, 644);
+    }
+
+    pthread_mutex_lock(&journal.lock);
+    long transactions = journal.transactions;
+    long commits = journal.commits;
+    pthread_mutex_unlock(&journal.lock);
+
+    pthread_t threads[COMMIT_CHECK_THREADS];
+    int threadIds[COMMIT_CHECK_THREADS];
+    for (int i = 0; i < COMMIT_CHECK_THREADS; i++) {
+        threadIds[i] = i;
+        pthread_create(&threads[i], NULL, concurrentCommits, &threadIds[i]);
+    }
+    for (int i = 0; i < COMMIT_CHECK_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_lock(&journal.lock);
+    transactions = journal.transactions - transactions;
+    commits = journal.commits - commits;
+    pthread_mutex_unlock(&journal.lock);
+
+    int result = 0;
+    char buffer[COMMIT_CHECK_APPENDS * 32];
+    for (int i = 0; i < COMMIT_CHECK_THREADS; i++) {
+        sprintf(fileName, "/commits/log_%d", i);
+        int handle = openFile(fileName, OPEN_READ);
+        int length = readHandle(handle, buffer, sizeof(buffer));
+        closeFile(handle);
+        if (length != expected) {
+            printf("Error: Log '%s' holds %d bytes instead of %d.\n", fileName, length, expected);
+            result = -1;
+        }
+    }
+
+    printf("Group commit: %ld transactions from %d threads in %ld journal writes (%.1f per write)\n", transactions, COMMIT_CHECK_THREADS, commits, commits ? (double) transactions / commits : 0.0);
+    if (commits >= transactions) {
+        printf("Error: No journal write carried more than one transaction.\n");
+        result = -1;
+    }
+    return result;
+}
+
+#define IO_CHECK_FILES 8
+#define IO_CHECK_SIZE (16 * DATA_BLOCK_SIZE)
+
+// Counts the requests of a batch that finished through their callback.
+typedef struct {
+    int finished;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} IoCheckBatch;
+
+void ioCheckCallback(IoRequest *request) {
+    IoCheckBatch *batch = request->userData;
+    pthread_mutex_lock(&batch->lock);
+    batch->finished++;
+    pthread_cond_signal(&batch->done);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+// Fills buffer with the contents file index holds after round. Every block is
+// tagged, so dedup cannot fold them together and each read loads its own.
+void fillIoCheck(char *buffer, int round, int index) {
+    for (int i = 0; i < IO_CHECK_SIZE; i++) {
+        buffer[i] = 'A' + (round + index + i) % 26;
+    }
+    for (int block = 0; block < IO_CHECK_SIZE / DATA_BLOCK_SIZE; block++) {
+        char tag[48];
+        int length = sprintf(tag, "round %d file %d block %d ", round, index, block);
+        memcpy(buffer + block * DATA_BLOCK_SIZE, tag, length);
+    }
+}
+
+// Submits a read or write of every check file at once. Even requests finish
+// through a callback and odd ones are collected by waitForIo. Reads must find
+// the contents of round and writes store them. Returns the number of requests
+// that failed or read the wrong contents.
+int runIoCheckBatch(int opcode, int round) {
+    char buffers[IO_CHECK_FILES][IO_CHECK_SIZE];
+    char paths[IO_CHECK_FILES][32];
+    IoRequest requests[IO_CHECK_FILES];
+    IoCheckBatch batch = {.lock = PTHREAD_MUTEX_INITIALIZER, .done = PTHREAD_COND_INITIALIZER};
+    int callbacks = 0;
+    int collected = 0;
+    int failed = 0;
+
+    for (int i = 0; i < IO_CHECK_FILES; i++) {
+        sprintf(paths[i], "/async/io_%d", i);
+        if (opcode == IO_OP_WRITE) {
+            fillIoCheck(buffers[i], round, i);
+        } else {
+            memset(buffers[i], 0, IO_CHECK_SIZE);
+        }
+        memset(&requests[i], 0, sizeof(IoRequest));
+        requests[i].opcode = opcode;
+        requests[i].path = paths[i];
+        requests[i].buffer = buffers[i];
+        requests[i].length = IO_CHECK_SIZE;
+        if (i % 2 == 0) {
+            requests[i].callback = ioCheckCallback;
+            requests[i].userData = &batch;
+        }
+        if (submitIo(&requests[i]) != 0) {
+            printf("Error: Failed to submit I/O for '%s'.\n", paths[i]);
+            requests[i].result = -1;
+            failed++;
+            continue;
+        }
+        if (i % 2 == 0) {
+            callbacks++;
+        }
+    }
+
+    while (waitForIo() != NULL) {
+        collected++;
+    }
+    pthread_mutex_lock(&batch.lock);
+    while (batch.finished < callbacks) {
+        pthread_cond_wait(&batch.done, &batch.lock);
+    }
+    pthread_mutex_unlock(&batch.lock);
+    if (callbacks + collected + failed != IO_CHECK_FILES) {
+        printf("Error: %d asynchronous requests never completed.\n", IO_CHECK_FILES - callbacks - collected - failed);
+        return IO_CHECK_FILES;
+    }
+
+    char expected[IO_CHECK_SIZE];
+    for (int i = 0; i < IO_CHECK_FILES; i++) {
+        if (requests[i].result < 0) {
+            continue;
+        }
+        fillIoCheck(expected, round, i);
+        if (opcode == IO_OP_READ && (requests[i].result != IO_CHECK_SIZE || memcmp(buffers[i], expected, IO_CHECK_SIZE) != 0)) {
+            printf("Error: Asynchronous read of '%s' returned the wrong contents.\n", paths[i]);
+            failed++;
+        } else if (opcode == IO_OP_WRITE && requests[i].result != 0) {
+            printf("Error: Asynchronous write of '%s' failed. Error code: %d\n", paths[i], requests[i].result);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+// Reads back what the previous round wrote, which the mount has left out of
+// the cache, then writes this round's contents and reads them again.
+int checkAsyncIo(int round) {
+    int failed = runIoCheckBatch(IO_OP_READ, round - 1);
+    failed += runIoCheckBatch(IO_OP_WRITE, round);
+    failed += runIoCheckBatch(IO_OP_READ, round);
+
+    pthread_mutex_lock(&ioEngine.lock);
+    printf("Async I/O check (%s): %d reads and %d writes, %d wrong; %ld requests on the ring, %ld in the pool, %ld ring reads\n",
+           ioEngine.useRing ? "io_uring" : "thread pool", 2 * IO_CHECK_FILES, IO_CHECK_FILES, failed, ioEngine.ringRequests,
+           ioEngine.pooledRequests, __atomic_load_n(&ioEngine.ringTransfers, __ATOMIC_RELAXED));
+    pthread_mutex_unlock(&ioEngine.lock);
+    return failed ? -1 : 0;
+}
+
+#define BENCH_DURATION_MS 500
+#define BENCH_FILE_SIZE (64 * 1024)
+#define BENCH_MAX_THREADS 8
+#define BENCH_ALLOCATION_BATCH 32
+#define BENCH_SHARED_READS 0
+#define BENCH_PRIVATE_WRITES 1
+#define BENCH_ALLOCATIONS 2
+
+typedef struct {
+    int threadId;
+    int scenario;
+    volatile int *stop;
+    long operations;
+} BenchWorker;
+
+// Allocates and frees batches of 1 to 4 block files, as a create-heavy
+// workload would, without the namespace lock getting in the way.
+void benchAllocations(BenchWorker *worker) {
+    Extent extents[BENCH_ALLOCATION_BATCH][MAX_EXTENTS];
+    int extentCounts[BENCH_ALLOCATION_BATCH];
+
+    while (!*worker->stop) {
+        int allocated = 0;
+        while (allocated < BENCH_ALLOCATION_BATCH) {
+            extentCounts[allocated] = allocateExtents(1 + allocated % 4, extents[allocated], MAX_EXTENTS);
+            if (extentCounts[allocated] < 0) {
+                break;
+            }
+            allocated++;
+        }
+        for (int i = 0; i < allocated; i++) {
+            releaseExtents(extents[i], extentCounts[i]);
+        }
+        worker->operations += allocated;
+    }
+}
+
+void *benchThread(void *arg) {
+    BenchWorker *worker = arg;
+    if (worker->scenario == BENCH_ALLOCATIONS) {
+        benchAllocations(worker);
+        return NULL;
+    }
+
+    char path[32];
+    char *buffer = malloc(BENCH_FILE_SIZE + 1);
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    // Readers share one file; writers each own theirs
+    int writer = worker->scenario == BENCH_PRIVATE_WRITES;
+    if (writer) {
+        sprintf(path, "/bench/private_%d", worker->threadId);
+        memset(buffer, 'a' + worker->threadId, BENCH_FILE_SIZE);
+        buffer[BENCH_FILE_SIZE] = '\0';
+    } else {
+        strcpy(path, "/bench/shared");
+    }
+
+    while (!*worker->stop) {
+        int result = writer ? writeFile(path, buffer) : readFileInto(path, buffer, BENCH_FILE_SIZE);
+        if (result < 0) {
+            break;
+        }
+        worker->operations++;
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+double benchScenario(int threadCount, int scenario) {
+    pthread_t threads[BENCH_MAX_THREADS];
+    BenchWorker workers[BENCH_MAX_THREADS];
+    volatile int stop = 0;
+
+    for (int i = 0; i < threadCount; i++) {
+        workers[i].threadId = i;
+        workers[i].scenario = scenario;
+        workers[i].stop = &stop;
+        workers[i].operations = 0;
+        pthread_create(&threads[i], NULL, benchThread, &workers[i]);
+    }
+
+    usleep(BENCH_DURATION_MS * 1000);
+    stop = 1;
+
+    long total = 0;
+    for (int i = 0; i < threadCount; i++) {
+        pthread_join(threads[i], NULL);
+        total += workers[i].operations;
+    }
+    return total * 1000.0 / BENCH_DURATION_MS;
+}
+
+// Measures read, write and allocation throughput as threads are added.
+// Readers share a file and writers use private ones, so neither should
+// serialize on a lock.
+int runBenchmark() {
+    if (initializeFileSystem() != 0) {
+        printf("Error: Failed to open volume image '%s'.\n", VOLUME_IMAGE_PATH);
+        return -1;
+    }
+
+    createDirectory("/bench", 755);
+    createFile("/bench/shared", BENCH_FILE_SIZE, 644);
+
+    // The readers need real contents, placed and written back to the image, so
+    // every read goes through the cache and the image rather than holes
+    char *contents = malloc(BENCH_FILE_SIZE + 1);
+    if (contents == NULL) {
+        printf("Error: Out of memory.\n");
+        unmountFileSystem();
+        return -1;
+    }
+    for (int i = 0; i < BENCH_FILE_SIZE; i++) {
+        contents[i] = 'A' + i % 26;
+    }
+    contents[BENCH_FILE_SIZE] = '\0';
+    writeFile("/bench/shared", contents);
+    free(contents);
+    flushAllDelayed();
+    flushBufferCache();
+    char path[32];
+    for (int i = 0; i < BENCH_MAX_THREADS; i++) {
+        sprintf(path, "/bench/private_%d", i);
+        createFile(path, BENCH_FILE_SIZE, 644);
+    }
+
+    printf("Threads  Shared reads/s  Private writes/s  Allocations/s\n");
+    for (int threadCount = 1; threadCount <= BENCH_MAX_THREADS; threadCount *= 2) {
+        double reads = benchScenario(threadCount, BENCH_SHARED_READS);
+        double writes = benchScenario(threadCount, BENCH_PRIVATE_WRITES);
+        double allocations = benchScenario(threadCount, BENCH_ALLOCATIONS);
+        printf("%7d  %14.0f  %16.0f  %13.0f\n", threadCount, reads, writes, allocations);
+    }
+
+    printCacheStats();
+    unmountFileSystem();
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        return runBenchmark();
+    }
+
+    if (initializeFileSystem() != 0) {
+        printf("Error: Failed to open volume image '%s'.\n", VOLUME_IMAGE_PATH);
+        return -1;
+    }
 
     // Create files
     createFile("file1.txt", 2048, 644);
@@ -244,6 +7390,9 @@ int main() {
     // List files
     listFiles();
 
+    // Both threads write the same block, which is stored once
+    setVolumeDedup(1);
+
     // Concurrent file access
     pthread_t thread1, thread2;
     int threadId1 = 1, threadId2 = 2;
@@ -251,6 +7400,141 @@ int main() {
     pthread_create(&thread2, NULL, concurrentFileAccess, &threadId2);
     pthread_join(thread1, NULL);
     pthread_join(thread2, NULL);
+    flushAllDelayed();
+    printf("Dedup ratio: %.2fx\n", dedupRatio());
+
+    // Delete files
+    deleteFile("file3.txt");
+    listFiles();
+
+    // Nested directories
+    createDirectory("/logs", 755);
+    createDirectory("/logs/2024", 755);
+    createFile("/logs/2024/app.log", 2048, 644);
+    writeFile("/logs/2024/app.log", "Log entry.");
+    printf("Contents of file '/logs/2024/app.log':\n");
+    readFile("/logs/2024/app.log");
+    printf("\n");
+    listDirectory("/logs");
+    deleteDirectory("/logs/2024");
+    deleteFile("/logs/2024/app.log");
+    deleteDirectory("/logs/2024");
+    deleteDirectory("/logs");
+
+    // Repeated I/O on one open file skips path lookup
+    int handle = openFile("file2.txt", OPEN_READ | OPEN_WRITE);
+    if (handle >= 0) {
+        char text[64] = {0};
+        pwriteHandle(handle, " More content.", 14, 17);
+        readHandle(handle, text, 31);
+        printf("Read through a handle: %s\n", text);
+        appendHandle(handle, "Tail.", 5);
+        closeFile(handle);
+    }
+
+    // Log lines compress well, so a compressed file takes a fraction of the blocks
+    createFile("app.log", 1, 644);
+    setFileCompression("app.log", 1);
+    handle = openFile("app.log", OPEN_READ | OPEN_WRITE);
+    if (handle >= 0) {
+        int64_t offset = 0;
+        for (int i = 0; i < 1000; i++) {
+            char line[64];
+            int length = snprintf(line, sizeof(line), "%06d INFO request served in %d ms\n", i, i % 17);
+            pwriteHandle(handle, line, length, offset);
+            offset += length;
+        }
+        closeFile(handle);
+    }
+    flushAllDelayed();
+    CompressionReport report;
+    if (compressionReport("app.log", &report) == 0) {
+        printf("Compression of 'app.log': %d blocks in %d units stored in %d (%.2fx), %.3f ms compressing\n",
+               report.expandedBlocks, report.unitCount, report.storedBlocks,
+               (report.storedBlocks > 0) ? (double) report.expandedBlocks / report.storedBlocks : 1.0,
+               report.compressNs / 1e6);
+    }
+
+    // A snapshot shares every block, so the old contents stay readable after
+    // an update, and a clone brings them back
+    if (createSnapshot("before-update") == 0) {
+        writeFile("file2.txt", "Replaced after the snapshot.");
+        cloneFile("/" SNAPSHOT_DIRECTORY "/before-update/file2.txt", "file2.restored");
+        printf("Contents of file 'file2.restored':\n");
+        readFile("file2.restored");
+        printf("\n");
+
+        // A crash leaves blocks shared by the snapshot and its files, which
+        // the rebuilt bitmap must count once and keep used
+        crashFileSystem();
+        int crashResult = mountFileSystem(VOLUME_IMAGE_PATH);
+        if (crashResult != 0) {
+            printf("Error: Failed to mount volume image after a crash. Error code: %d\n", crashResult);
+            return crashResult;
+        }
+        printf("Remounted after a crash with %d free blocks; snapshot copy of 'file2.txt':\n", countFreeBlocks());
+        readFile("/" SNAPSHOT_DIRECTORY "/before-update/file2.txt");
+        printf("\n");
+        deleteSnapshot("before-update");
+    }
+
+    // Every block of every file still matches its checksum
+    printf("Scrub found %d corrupt blocks.\n", scrubVolume());
+
+    // Extents per file
+    printFragmentationStats();
+    printCacheStats();
+
+    // Threads committing at once share journal writes
+    checkGroupCommit();
+    printJournalStats();
+
+    // A batch of asynchronous reads and writes, once on io_uring and once on
+    // the thread pool. Each round mounts afresh, so its first reads miss the
+    // cache and go to the image.
+    char ioCheckBuffer[IO_CHECK_SIZE];
+    createDirectory("/async", 755);
+    for (int i = 0; i < IO_CHECK_FILES; i++) {
+        char path[32];
+        sprintf(path, "/async/io_%d", i);
+        createFile(path, IO_CHECK_SIZE, 644);
+        fillIoCheck(ioCheckBuffer, 0, i);
+        IoRequest request = {.opcode = IO_OP_WRITE, .path = path, .buffer = ioCheckBuffer, .length = IO_CHECK_SIZE};
+        executeIo(&request);
+    }
+    for (int round = 1; round <= 2; round++) {
+        useIoUring = (round == 1);
+        unmountFileSystem();
+        int ioMountResult = mountFileSystem(VOLUME_IMAGE_PATH);
+        if (ioMountResult != 0) {
+            printf("Error: Failed to mount volume image. Error code: %d\n", ioMountResult);
+            return ioMountResult;
+        }
+        checkAsyncIo(round);
+    }
+    useIoUring = 1;
+
+    // The volume grows while mounted, without moving any block
+    if (growVolume(2 * DEFAULT_BLOCK_COUNT) == 0) {
+        printf("Volume grown to %u blocks, %d free.\n", superblock->blockCount, countFreeBlocks());
+    }
+
+    // Everything survives an unmount and mount
+    unmountFileSystem();
+    int mountResult = mountFileSystem(VOLUME_IMAGE_PATH);
+    if (mountResult != 0) {
+        printf("Error: Failed to mount volume image. Error code: %d\n", mountResult);
+        return mountResult;
+    }
+    listFiles();
+    printf("Contents of file 'file1.txt':\n");
+    readFile("file1.txt");
+    printf("\n");
+    uint32_t hash;
+    if (checksumFile("file1.txt", &hash) == 0) {
+        printf("Checksum of file 'file1.txt': %08x\n", hash);
+    }
+    unmountFileSystem();
 
     return 0;
-}
\ No newline at end of file
+}